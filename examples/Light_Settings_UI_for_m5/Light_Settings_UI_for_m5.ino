@@ -8,6 +8,8 @@
 
 #include <WiFi.h>
 #include <StreamString.h>
+#include <driver/gpio.h>
+#include <hal/gpio_ll.h>
 #include "GvmLightControl.h"
 
 int lcd_off = 0;
@@ -16,20 +18,67 @@ unsigned long last_button_millis = 0;
 #define INACTIVE_SCREEN_OFF_MILLIS   10000 // Milliseconds since last button press to power down LCD backlight
 #define INACTIVE_POWER_OFF_MILLIS    20000 // Milliseconds since last button press to switch off
 #define INACTIVE_OFF_WHEN_PLUGGED_IN 1     // Whether to do inactive off when plugged in 
+#define BUTTON_SETTLE_MILLIS         15    // Milliseconds for a button to stop bouncing after it changes
+#define SERIAL_POLL_MILLIS           1000  // Longest to sleep before checking the serial console
+
+volatile int button_changed = 0;
 
 // #define DEBUG
 
+uint8_t connect_bssid[6];
+int connect_attempt = 0;
+
 static void onWiFiConnectAttempt(uint8_t *bssid, int attempt) {
-  M5.Lcd.setCursor(0, 0, 2);        
-  M5.Lcd.printf("Trying\nBSSID %02x:%02x:%02x:%02x:%02x:%02x\nAttempt %d\n", 
+  Serial.printf("Trying BSSID %02x:%02x:%02x:%02x:%02x:%02x attempt %d\n", 
                 bssid[0], bssid[1], bssid[2], bssid[3], bssid[4], bssid[5], 
                 attempt);
+  // Show the cached status of the light while we connect to it
+  memcpy(connect_bssid, bssid, sizeof(connect_bssid));
+  connect_attempt = attempt;
+  update_screen_status();
 }
 
 static void onStatusUpdated() {
   update_screen_status();
 }
 
+#ifdef ARDUINO_M5Stack_Core_ESP32
+static const int button_pins[] = { BUTTON_A_PIN, BUTTON_B_PIN, BUTTON_C_PIN };
+#else
+// The AXP192 pulls its IRQ line (GPIO 35) low when the power button is pressed
+static const int button_pins[] = { BUTTON_A_PIN, BUTTON_B_PIN, 35 };
+#endif
+#define NUM_BUTTON_PINS ((int) (sizeof(button_pins) / sizeof(button_pins[0])))
+volatile int button_level[NUM_BUTTON_PINS]; // Level each button pin last read
+
+// Buttons wake the loop rather than it polling them. In light sleep GPIO
+// edge interrupts don't fire and only a level wakes the chip, so each pin
+// interrupts on the level it isn't at and the handler flips that, which
+// works like CHANGE and wakes the chip from sleep. While WiFi power save is
+// on GPIO39 picks up short spurious low pulses (ESP32 errata 3.11), a pin
+// that still reads its last level when the handler runs had one of these
+static void IRAM_ATTR onButtonInterrupt(void *arg) {
+  int i = (int) (intptr_t) arg;
+  gpio_num_t pin = (gpio_num_t) button_pins[i];
+  int level = gpio_ll_get_level(&GPIO, pin);
+  if (level == button_level[i])
+    return;
+  button_level[i] = level;
+  gpio_ll_set_intr_type(&GPIO, pin, level ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+  button_changed = 1;
+  GVM.wake();
+}
+
+static void attach_button_interrupts() {
+  for (int i = 0; i < NUM_BUTTON_PINS; i++) {
+    button_level[i] = digitalRead(button_pins[i]);
+    attachInterruptArg(digitalPinToInterrupt(button_pins[i]), onButtonInterrupt, (void *) (intptr_t) i, CHANGE);
+    // Makes the pin a light sleep wake source, switching it to a level interrupt
+    gpio_wakeup_enable((gpio_num_t) button_pins[i], 
+                       button_level[i] ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+  }
+}
+
 void setup() {
   Serial.begin(115200);
   Serial.println("M5 starting...\n");
@@ -76,6 +125,9 @@ void setup() {
   
   GVM.callbackOnWiFiConnectAttempt(onWiFiConnectAttempt);
   GVM.callbackOnStatusUpdated(onStatusUpdated);
+
+  // Show the last light we used from the state cache while we look for it
+  update_screen_status();
   
   int networks_found = 0;
   while (GVM.find_and_join_light_wifi(&networks_found)) {
@@ -94,6 +146,10 @@ void setup() {
   Serial.printf("Base station is: %s\n", WiFi.BSSIDstr().c_str());
   Serial.printf("Receive strength is: %d\n", WiFi.RSSI());
 
+  // Let the radio and CPU sleep while we wait for buttons or the light
+  GVM.setPowerSave(true);
+  attach_button_interrupts();
+
   // Write info to LCD.
   update_screen_status();
 
@@ -117,7 +173,16 @@ void update_screen_status() {
 
   switch (screen_mode) {
     case -1:
-      o.printf("BS: %s\n", WiFi.BSSIDstr().c_str());
+      if (WiFi.status() == WL_CONNECTED)
+        o.printf("BS: %s\n", WiFi.BSSIDstr().c_str());
+      else if (connect_attempt)
+        o.printf("Joining %02x:%02x:%02x #%d\n", 
+                 connect_bssid[3], connect_bssid[4], connect_bssid[5], connect_attempt);
+      else
+        o.printf("Searching\n");
+      // Values from the state cache are shown until the light reports
+      if (!light_status.confirmed && light_status.on_off != -1)
+        o.printf("(cached) ");
       if (light_status.on_off != -1) 
         o.printf("Light On %d\n", light_status.on_off);
       if (light_status.hue != -1) 
@@ -238,6 +303,7 @@ void test_screen_idle_off() {
   if (millis() - last_button_millis > INACTIVE_POWER_OFF_MILLIS && 
       (INACTIVE_OFF_WHEN_PLUGGED_IN || battery_power())) {
     Serial.printf("** Powering off **\n");
+    GVM.flushStateCache();
     power_off();
   }
 }
@@ -367,5 +433,18 @@ void loop() {
     }
   }
 
-  GVM.wait_msg_or_timeout();
+  // Sleep until the light sends something, a button changes or the screen
+  // is due to switch off. A button that has just changed is read again 
+  // once it has settled, as the interrupt may have been a bounce
+  unsigned long now = millis();
+  unsigned long idle_deadline = last_button_millis + 1 +
+                                (lcd_off ? INACTIVE_POWER_OFF_MILLIS : INACTIVE_SCREEN_OFF_MILLIS);
+  long sleep_millis = (long) (idle_deadline - now);
+  if (sleep_millis <= 0 || sleep_millis > SERIAL_POLL_MILLIS)
+    sleep_millis = SERIAL_POLL_MILLIS;
+  if (button_changed) {
+    button_changed = 0;
+    sleep_millis = BUTTON_SETTLE_MILLIS;
+  }
+  GVM.wait_until(now + sleep_millis);
 }
@@ -0,0 +1,157 @@
+/*
+  Network_Scheduler_Test - Exercises GvmNetworkScheduler against a mocked
+  WiFi layer and the light simulator in extras/gvm_light_sim.
+
+  The ESP32 joins an ordinary WiFi network that a Linux host running
+  'gvm_light_sim -n 3' is on. The mock WiFi layer reports three light
+  networks and, rather than hopping between them, tells the simulator
+  which light to answer as when one is "joined". The network of light 2
+  can never be joined. The results are printed to Serial.
+*/
+
+#include <WiFi.h>
+#include <WiFiUdp.h>
+#include "GvmNetworkScheduler.h"
+
+#define TEST_SSID          "your_network"
+#define TEST_PASSWORD      "your_password"
+
+#define SIM_SELECT_PORT    2526 // Port gvm_light_sim takes the light to answer as on
+#define MOCK_NETWORKS      3
+#define MOCK_UNREACHABLE   2    // Joining this network always fails
+#define MOCK_DHCP_MILLIS   400  // Time a join takes when it needs an address from DHCP
+#define MOCK_JOIN_MILLIS   100  // Time a join takes reusing an address
+
+class MockWiFiLayer : public GvmWiFiLayer {
+  public:
+    MockWiFiLayer() : last_join(-1), joins(0) {};
+
+    int scan(const char *ssid, GvmNetworkInfo *found, int max_found) {
+      int n = 0;
+      for (; n < MOCK_NETWORKS && n < max_found; n++) {
+        found[n] = GvmNetworkInfo();
+        found[n].bssid[0] = 0x02; // Locally administered
+        found[n].bssid[5] = n;
+        found[n].channel = 1 + n * 5;
+        found[n].rssi = -50 - n;
+      }
+      return n;
+    }
+
+    int join(const char *ssid, const char *password, const GvmNetworkInfo &network,
+             uint32_t *ip, uint32_t *gateway, uint32_t *subnet) {
+      uint8_t light = network.bssid[5];
+      last_join = light;
+      joins++;
+      delay(*ip ? MOCK_JOIN_MILLIS : MOCK_DHCP_MILLIS);
+      if (light == MOCK_UNREACHABLE)
+        return -1;
+
+      // The simulator answers as the light whose network we're on
+      udp.beginPacket(IPAddress(255, 255, 255, 255), SIM_SELECT_PORT);
+      udp.write(&light, sizeof(light));
+      udp.endPacket();
+
+      *ip = WiFi.localIP();
+      *gateway = WiFi.gatewayIP();
+      *subnet = WiFi.subnetMask();
+      return 0;
+    }
+
+  public:
+    int last_join; // Light of the last network joined
+    int joins;
+
+  private:
+    WiFiUDP udp;
+};
+
+GvmLightConfig config;
+GvmLightControl *lights;
+MockWiFiLayer mock;
+int failures = 0;
+
+#define CHECK(cond) check(cond, #cond, __LINE__)
+
+static void check(bool ok, const char *what, int line) {
+  Serial.printf("%s line %d: %s\n", ok ? "PASS" : "FAIL", line, what);
+  if (!ok)
+    failures++;
+}
+
+void setup() {
+  Serial.begin(115200);
+
+  WiFi.begin(TEST_SSID, TEST_PASSWORD);
+  while (WiFi.status() != WL_CONNECTED)
+    delay(100);
+  Serial.printf("Connected, IP %s\n", WiFi.localIP().toString().c_str());
+
+  // The simulated lights shouldn't end up in the warm start cache
+  config.state_cache = NULL;
+  lights = new GvmLightControl(config);
+  GvmNetworkScheduler scheduler(*lights, &mock);
+
+  // Discovery remembers each network once
+  CHECK(scheduler.discover() == MOCK_NETWORKS);
+  CHECK(scheduler.discover() == MOCK_NETWORKS);
+  CHECK(scheduler.getStaleness(0) == GVM_NEVER);
+  CHECK(scheduler.getHopMillis(0) == GVM_NEVER);
+
+  // A network with settings queued is visited first and all of them are
+  // sent in one visit, a later setting replaces an earlier one
+  scheduler.queue_set(1, LIGHT_VAR_BRIGHTNESS, 20);
+  scheduler.queue_set(1, LIGHT_VAR_CCT, 32);
+  scheduler.queue_set(1, LIGHT_VAR_BRIGHTNESS, 25);
+  CHECK(scheduler.pending_count(1) == 2);
+  CHECK(scheduler.visit_next() == 2);
+  CHECK(mock.last_join == 1);
+  CHECK(scheduler.pending_count(1) == 0);
+  LightStatus status = scheduler.getNetworkStatus(1);
+  CHECK(status.confirmed && status.brightness == 25 && status.cct == 32);
+  CHECK(scheduler.getStaleness(1) < 1000);
+  CHECK(scheduler.getHopMillis(1) >= MOCK_DHCP_MILLIS);
+
+  // With nothing queued the networks take turns, a failed visit leaves
+  // the light never seen
+  CHECK(scheduler.visit_next() == -1);
+  CHECK(mock.last_join == MOCK_UNREACHABLE);
+  CHECK(scheduler.getStaleness(MOCK_UNREACHABLE) == GVM_NEVER);
+  CHECK(scheduler.visit_next() == 0);
+  CHECK(mock.last_join == 0);
+  CHECK(scheduler.getNetworkStatus(0).brightness == 50);
+
+  // The address from the first join is reused, which is quicker
+  scheduler.queue_set(1, LIGHT_VAR_HUE, 10);
+  CHECK(scheduler.visit_next() == 1);
+  CHECK(mock.last_join == 1);
+  CHECK(scheduler.getHopMillis(1) < MOCK_DHCP_MILLIS);
+  CHECK(scheduler.getAverageHopMillis(1) > scheduler.getHopMillis(1));
+
+  // A setting the light reports it already has isn't sent
+  scheduler.queue_set(1, LIGHT_VAR_HUE, 10);
+  CHECK(scheduler.visit_next() == 0);
+  CHECK(mock.last_join == 1);
+
+  // Settings for every light stay queued for the one that can't be reached,
+  // which rests after failing rather than costing a join timeout every turn
+  scheduler.queue_set_all(LIGHT_VAR_ON_OFF, 0);
+  CHECK(scheduler.visit_next() == 1);
+  CHECK(scheduler.visit_next() == 1);
+  CHECK(scheduler.getNetworkStatus(0).on_off == 0 && scheduler.getNetworkStatus(1).on_off == 0);
+  CHECK(scheduler.pending_count(MOCK_UNREACHABLE) == 1);
+  scheduler.visit_next();
+  CHECK(mock.last_join != MOCK_UNREACHABLE);
+
+  // Once it has rested it's tried again
+  delay(GVM_FAIL_BACKOFF_MILLIS);
+  CHECK(scheduler.visit_next() == -1);
+  CHECK(mock.last_join == MOCK_UNREACHABLE);
+  CHECK(scheduler.pending_count(MOCK_UNREACHABLE) == 1);
+
+  Serial.printf("%d joins, %d failures\n", mock.joins, failures);
+}
+
+void loop() {
+  delay(1000);
+}
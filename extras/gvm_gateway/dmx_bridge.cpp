@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "dmx_bridge.h"
+
+#define ARTNET_OP_DMX        0x5000
+#define ARTNET_HDR_LEN       18
+#define E131_HDR_LEN         126  // Up to and including the DMX start code
+#define E131_OPT_PREVIEW     0x80
+#define E131_OPT_TERMINATED  0x40
+#define DMX_RX_BATCH         16   // Datagrams read per recvmmsg call
+#define DMX_RX_LEN           640  // Larger than the biggest Art-Net or sACN DMX packet
+
+static const uint8_t artnet_id[8] = { 'A', 'r', 't', '-', 'N', 'e', 't', 0 };
+static const uint8_t e131_id[12] = { 'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0 };
+
+static struct dmx_footprint footprints[DMX_MAX_FOOTPRINTS];
+static int num_footprints = 0;
+
+/* Receive buffers are static so reading a batch never allocates */
+static uint8_t rx_buffers[DMX_RX_BATCH][DMX_RX_LEN];
+static struct iovec rx_iovecs[DMX_RX_BATCH];
+static struct mmsghdr rx_msgs[DMX_RX_BATCH];
+
+static inline int be16(const uint8_t *p) {
+  return p[0] << 8 | p[1];
+}
+
+static inline uint32_t be32(const uint8_t *p) {
+  return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static int layout_var(char c) {
+  switch (c) {
+    case 'o': return LIGHT_VAR_ON_OFF;
+    case 'c': return LIGHT_VAR_CHANNEL;
+    case 'b': return LIGHT_VAR_BRIGHTNESS;
+    case 'k': return LIGHT_VAR_CCT;
+    case 'h': return LIGHT_VAR_HUE;
+    case 's': return LIGHT_VAR_SATURATION;
+    case '-': return -1;
+  }
+  return -2;
+}
+
+int dmx_add_footprint(const char *spec) {
+  if (num_footprints == DMX_MAX_FOOTPRINTS)
+    return -1;
+
+  struct dmx_footprint *f = &footprints[num_footprints];
+  // One letter more than fits is read so a layout that's too long is caught,
+  // and end is where parsing stopped so anything after the spec is too
+  char layout[DMX_MAX_LAYOUT + 2] = DMX_DEFAULT_LAYOUT;
+  int end = 0;
+  int fields = sscanf(spec, "%d:%d:%d%n:%17s%n", &f->light, &f->universe, &f->address, &end, layout, &end);
+  if (fields < 3 || spec[end] || f->light < 0 || f->universe < 0 || f->universe > DMX_MAX_UNIVERSE)
+    return -1;
+
+  f->num_slots = strlen(layout);
+  if (f->num_slots > DMX_MAX_LAYOUT || f->address < 1 || f->address + f->num_slots - 1 > DMX_UNIVERSE_SLOTS)
+    return -1;
+
+  int used = 0;
+  for (int i = 0; i < f->num_slots; i++) {
+    int var = layout_var(layout[i]);
+    if (var == -2 || (var >= 0 && (used & (1 << var))))
+      return -1;
+    if (var >= 0)
+      used |= 1 << var;
+    f->slot_var[i] = var;
+  }
+
+  for (int var = 0; var < LIGHT_VAR_COUNT; var++)
+    f->last_value[var] = -1;
+
+  num_footprints++;
+  return 0;
+}
+
+int dmx_max_light() {
+  int max_light = -1;
+  for (int i = 0; i < num_footprints; i++)
+    if (footprints[i].light > max_light)
+      max_light = footprints[i].light;
+  return max_light;
+}
+
+static int open_dmx_port(int port) {
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  int yes = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+    fprintf(stderr, "Can't bind DMX port %d: %s\n", port, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int dmx_open_artnet() {
+  return open_dmx_port(DMX_ARTNET_PORT);
+}
+
+int dmx_open_e131() {
+  int fd = open_dmx_port(DMX_E131_PORT);
+  if (fd < 0)
+    return -1;
+
+  // sACN sources multicast each universe to 239.255.<universe high>.<universe low>
+  for (int i = 0; i < num_footprints; i++) {
+    int universe = footprints[i].universe;
+    int joined = 0;
+    for (int j = 0; j < i; j++)
+      joined |= footprints[j].universe == universe;
+    if (joined || universe < 1)
+      continue;
+
+    struct ip_mreq mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.imr_multiaddr.s_addr = htonl(0xEFFF0000 | universe);
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)))
+      fprintf(stderr, "Can't join sACN universe %d: %s\n", universe, strerror(errno));
+  }
+
+  return fd;
+}
+
+int dmx_decode_artnet(const uint8_t *pkt, int len, int *universe, const uint8_t **data) {
+  if (len < ARTNET_HDR_LEN || memcmp(pkt, artnet_id, sizeof(artnet_id)))
+    return -1;
+
+  // The op code is the only little endian field
+  if ((pkt[8] | pkt[9] << 8) != ARTNET_OP_DMX)
+    return -1;
+
+  int slots = be16(pkt + 16);
+  if (slots > DMX_UNIVERSE_SLOTS || ARTNET_HDR_LEN + slots > len)
+    return -1;
+
+  *universe = (pkt[15] & 0x7F) << 8 | pkt[14]; // Net then SubUni
+  *data = pkt + ARTNET_HDR_LEN;
+  return slots;
+}
+
+int dmx_decode_e131(const uint8_t *pkt, int len, int *universe, const uint8_t **data) {
+  if (len < E131_HDR_LEN || memcmp(pkt + 4, e131_id, sizeof(e131_id)))
+    return -1;
+
+  // Root layer data vector, framing layer data packet vector, DMP set property
+  if (be32(pkt + 18) != 0x4 || be32(pkt + 40) != 0x2 || pkt[117] != 0x2)
+    return -1;
+
+  // Preview data isn't meant for output, a terminated stream carries no new levels
+  if (pkt[112] & (E131_OPT_PREVIEW | E131_OPT_TERMINATED))
+    return -1;
+
+  // Only the null start code carries dimmer levels
+  int slots = be16(pkt + 123) - 1;
+  if (pkt[125] != 0 || slots < 0 || slots > DMX_UNIVERSE_SLOTS || E131_HDR_LEN + slots > len)
+    return -1;
+
+  *universe = be16(pkt + 113);
+  *data = pkt + E131_HDR_LEN;
+  return slots;
+}
+
+/* Scale a DMX level onto min..max with equal sized steps */
+static inline int scale_dmx(int level, int min, int max) {
+  return min + level * (max - min + 1) / 256;
+}
+
+void dmx_apply_universe(int universe, const uint8_t *data, int slots, dmx_set_var_cb set_var) {
+  for (int i = 0; i < num_footprints; i++) {
+    struct dmx_footprint *f = &footprints[i];
+    if (f->universe != universe)
+      continue;
+
+    for (int slot = 0; slot < f->num_slots; slot++) {
+      int var = f->slot_var[slot];
+      int dmx_slot = f->address - 1 + slot;
+      if (var < 0 || dmx_slot >= slots)
+        continue;
+
+      int min, max;
+      gvm_var_range(var, &min, &max);
+      int value = scale_dmx(data[dmx_slot], min, max);
+      if (value == f->last_value[var])
+        continue;
+
+      f->last_value[var] = value;
+      set_var(f->light, var, value);
+    }
+  }
+}
+
+void dmx_read(int fd, int is_e131, dmx_set_var_cb set_var) {
+  int received;
+
+  do {
+    for (int i = 0; i < DMX_RX_BATCH; i++) {
+      rx_iovecs[i].iov_base = rx_buffers[i];
+      rx_iovecs[i].iov_len = DMX_RX_LEN;
+      memset(&rx_msgs[i].msg_hdr, 0, sizeof(rx_msgs[i].msg_hdr));
+      rx_msgs[i].msg_hdr.msg_iov = &rx_iovecs[i];
+      rx_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    received = recvmmsg(fd, rx_msgs, DMX_RX_BATCH, MSG_DONTWAIT, NULL);
+    for (int i = 0; i < received; i++) {
+      int universe;
+      const uint8_t *data;
+      int len = rx_msgs[i].msg_len;
+      int slots = is_e131 ? dmx_decode_e131(rx_buffers[i], len, &universe, &data)
+                          : dmx_decode_artnet(rx_buffers[i], len, &universe, &data);
+      if (slots > 0)
+        dmx_apply_universe(universe, data, slots, set_var);
+    }
+  } while (received == DMX_RX_BATCH);
+}
@@ -0,0 +1,66 @@
+/*
+  dmx_bridge.h - Art-Net and sACN (E1.31) ingest for the GVM gateway.
+
+  Each footprint maps a run of DMX channels in a universe to the settings
+  of one light. DMX values (0-255) are scaled to the range each setting
+  accepts and only settings whose scaled value changed are passed on, so
+  a console refreshing a universe at 44Hz doesn't generate any traffic to
+  the lights unless a fader actually moves far enough to matter.
+
+  Decoding works directly on the received datagram, nothing is allocated
+  per packet.
+*/
+
+#ifndef DmxBridge_h
+#define DmxBridge_h
+
+#include <stdint.h>
+#include "util/GvmProtocol.h"
+
+#define DMX_ARTNET_PORT      6454
+#define DMX_E131_PORT        5568
+#define DMX_MAX_FOOTPRINTS   32
+#define DMX_UNIVERSE_SLOTS   512
+#define DMX_MAX_LAYOUT       16
+#define DMX_MAX_UNIVERSE     0x7FFF // Art-Net port addresses are 15 bits
+
+/* Default footprint layout, one DMX channel per setting in LIGHT_VAR_ order.
+ * o = on/off, c = channel, b = brightness, k = CCT, h = hue, s = saturation,
+ * '-' skips a DMX channel */
+#define DMX_DEFAULT_LAYOUT   "ocbkhs"
+
+struct dmx_footprint {
+  int light;                       // Gateway light index
+  int universe;                    // Art-Net port address or sACN universe
+  int address;                     // First DMX channel, 1 based
+  int num_slots;                   // Number of DMX channels used
+  int8_t slot_var[DMX_MAX_LAYOUT]; // LIGHT_VAR_ for each DMX channel, -1 to skip
+  int last_value[LIGHT_VAR_COUNT]; // Last scaled value passed on, -1 if none yet
+};
+
+/* Called for every setting whose scaled value changed */
+typedef void (*dmx_set_var_cb)(int light, int var, int value);
+
+/* Add a footprint from a 'light:universe:address[:layout]' spec. Returns -1 if it's not valid */
+int dmx_add_footprint(const char *spec);
+
+/* Highest light index used by any footprint, -1 if there are none */
+int dmx_max_light();
+
+/* Open a non blocking UDP socket for Art-Net or sACN. For sACN the multicast
+ * group of every universe used by a footprint is joined */
+int dmx_open_artnet();
+int dmx_open_e131();
+
+/* Decode a datagram, returns the number of DMX slots and sets universe and
+ * data, or returns -1 if it isn't DMX data */
+int dmx_decode_artnet(const uint8_t *pkt, int len, int *universe, const uint8_t **data);
+int dmx_decode_e131(const uint8_t *pkt, int len, int *universe, const uint8_t **data);
+
+/* Apply the slots of a universe to every footprint in it */
+void dmx_apply_universe(int universe, const uint8_t *data, int slots, dmx_set_var_cb set_var);
+
+/* Read and apply every datagram waiting on an Art-Net or sACN socket */
+void dmx_read(int fd, int is_e131, dmx_set_var_cb set_var);
+
+#endif
@@ -0,0 +1,708 @@
+/*
+  gvm_gateway.cpp - Linux daemon that owns the GVM light sockets and
+  shares them between any number of local clients.
+
+  Only one process on a host can sensibly own the UDP ports the lights
+  use. The gateway binds them, keeps the last status reported by the
+  lights and serves clients over a Unix domain socket using the protocol
+  in gvm_gateway_protocol.h. Sets from all clients are merged into a
+  single output stream that is paced so the lights have time to absorb
+  each command (when commands are sent too quickly the lights drop them).
+
+  Each light index is one lighting network. With -i options every network
+  is bound to its own network interface, so one gateway can drive several
+  isolated lighting networks on separate NICs.
+
+  The gateway can also act as an Art-Net / sACN (E1.31) bridge so DMX
+  consoles can drive the lights, see dmx_bridge.h.
+
+  With -c the last status of each light is kept in a file, so after a
+  restart clients see the lights' state straight away rather than after
+  the next status report. Cached values aren't trusted to suppress sets
+  until the light confirms them.
+
+  Build with:
+    g++ -O2 -Wall -I../../src -o gvm_gateway gvm_gateway.cpp \
+        dmx_bridge.cpp ../../src/util/GvmProtocol.cpp ../../src/util/HexFunctions.cpp
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "util/GvmProtocol.h"
+#include "gvm_gateway_protocol.h"
+#include "dmx_bridge.h"
+
+static int debugMsgs = 0;
+#define DEBUG(format, ...) if (debugMsgs) { fprintf(stderr, format, ##__VA_ARGS__); };
+#define ERROR(format, ...) fprintf(stderr, format, ##__VA_ARGS__);
+
+#define GW_MAX_CLIENTS     64
+#define GW_MAX_LIGHTS      8
+#define GW_DEFAULT_PACE_MS 25 // Minimum time between datagrams sent to a light
+#define GW_CACHE_WRITE_MS  5000 // Status changes are batched this long before the cache file is written
+
+/* Each epoll registration carries the kind of FD and an index */
+#define EV_LISTEN    1
+#define EV_SIGNAL    2
+#define EV_CLIENT    3
+#define EV_LIGHT_UDP 4
+#define EV_LIGHT_TMR 5
+#define EV_ARTNET    6
+#define EV_E131      7
+#define EV_CACHE_TMR 8
+#define EV_DATA(kind, idx) (((uint64_t) (kind) << 32) | (uint32_t) (idx))
+#define EV_KIND(data)      ((int) ((data) >> 32))
+#define EV_IDX(data)       ((int) ((data) & 0xFFFFFFFF))
+
+struct gw_client {
+  int fd;
+  int subscribed;
+};
+
+struct gw_light {
+  char interface[IFNAMSIZ];           // Network interface the light is on, empty for any
+  uint32_t broadcast_addr;            // Where to send, network byte order
+  int send_fd;                        // Bound to GVM_SEND_PORT, used to broadcast
+  int recv_fd;                        // Bound to GVM_RECV_PORT, status broadcasts
+  int timer_fd;                       // Paces the output to the light
+  int timer_armed;
+  LightStatus status;                 // Last status reported by the light
+  int pending_value[LIGHT_VAR_COUNT]; // Merged sets from all clients
+  int pending_mask;                   // Bit (1 << LIGHT_VAR_x) set if pending_value[x] is to be sent
+  int next_var;                       // Round robin position in pending_mask
+  int hello_due;                      // Send a hello once the pending sets are done
+};
+
+static int epoll_fd = -1;
+static int pace_ms = GW_DEFAULT_PACE_MS;
+static struct gw_client clients[GW_MAX_CLIENTS];
+static struct gw_light lights[GW_MAX_LIGHTS];
+static int num_lights = 0;
+static const char *cache_path = NULL;
+static int cache_timer_fd = -1;
+static int cache_dirty = 0;
+
+static int epoll_add(int fd, int kind, int idx) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u64 = EV_DATA(kind, idx);
+  return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int open_udp_port(int port, const char *interface) {
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  int yes = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(yes));
+
+  /* Binding to the device lets several networks share the light ports
+   * and makes broadcasts go out of (and only be received from) that NIC */
+  if (interface[0] && setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, interface, strlen(interface))) {
+    ERROR("Can't bind to interface %s: %s\n", interface, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+    ERROR("Can't bind UDP port %d: %s\n", port, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int open_listen_socket(const char *path) {
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    ERROR("Socket path too long: %s\n", path);
+    return -1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, 16)) {
+    ERROR("Can't listen on %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int broadcast_udp(struct gw_light *l, const void *d, int len) {
+  struct sockaddr_in broadcast_addr;
+  memset(&broadcast_addr, 0, sizeof(broadcast_addr));
+  broadcast_addr.sin_family = AF_INET;
+  broadcast_addr.sin_port = htons(GVM_SEND_PORT);
+  broadcast_addr.sin_addr.s_addr = l->broadcast_addr;
+  return sendto(l->send_fd, d, len, 0, (const struct sockaddr *) &broadcast_addr, sizeof(broadcast_addr));
+}
+
+/* Parse an 'interface[:broadcast address]' spec into a light */
+static int parse_network(struct gw_light *l, const char *spec) {
+  *l = gw_light();
+  l->broadcast_addr = INADDR_BROADCAST;
+
+  const char *sep = strchr(spec, ':');
+  int name_len = sep ? sep - spec : (int) strlen(spec);
+  if (name_len < 1 || name_len >= IFNAMSIZ)
+    return -1;
+  memcpy(l->interface, spec, name_len);
+
+  struct in_addr addr;
+  if (sep) {
+    if (!inet_aton(sep + 1, &addr))
+      return -1;
+    l->broadcast_addr = addr.s_addr;
+  }
+  return 0;
+}
+
+static int open_light(struct gw_light *l, int idx) {
+  l->send_fd = open_udp_port(GVM_SEND_PORT, l->interface);
+  l->recv_fd = open_udp_port(GVM_RECV_PORT, l->interface);
+  l->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (l->send_fd < 0 || l->recv_fd < 0 || l->timer_fd < 0)
+    return -1;
+
+  if (epoll_add(l->send_fd, EV_LIGHT_UDP, idx) ||
+      epoll_add(l->recv_fd, EV_LIGHT_UDP, idx) ||
+      epoll_add(l->timer_fd, EV_LIGHT_TMR, idx))
+    return -1;
+
+  // Ask the light(s) to report so we start with a known state
+  l->hello_due = 1;
+  return 0;
+}
+
+/* Cache entries are keyed by network rather than light index, so a
+ * light's state isn't restored onto another network if the -i options
+ * are reordered. The ID is the broadcast address and a hash of the
+ * interface name */
+static void cache_id(const struct gw_light *l, uint8_t *id) {
+  uint32_t hash = 2166136261u; // FNV-1a
+  for (const char *c = l->interface; *c; c++)
+    hash = (hash ^ (uint8_t) *c) * 16777619u;
+  memcpy(id, &l->broadcast_addr, 4);
+  id[4] = (hash >> 24) ^ (hash >> 8);
+  id[5] = (hash >> 16) ^ hash;
+}
+
+/* Restore the status saved by write_cache, the restored status isn't confirmed */
+static void load_cache() {
+  uint8_t snapshot[GVM_SNAPSHOT_LEN(GW_MAX_LIGHTS)];
+  uint8_t ids[GW_MAX_LIGHTS][GVM_SNAPSHOT_ID_LEN];
+  LightStatus status[GW_MAX_LIGHTS];
+
+  int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    DEBUG("No status cache at %s\n", cache_path);
+    return;
+  }
+  int len = read(fd, snapshot, sizeof(snapshot));
+  close(fd);
+
+  int count = len > 0 ? gvm_snapshot_decode(snapshot, len, ids, status, GW_MAX_LIGHTS) : -1;
+  if (count < 0) {
+    ERROR("Ignoring invalid status cache %s\n", cache_path);
+    return;
+  }
+
+  for (int i = 0; i < num_lights; i++) {
+    uint8_t id[GVM_SNAPSHOT_ID_LEN];
+    cache_id(&lights[i], id);
+    for (int j = 0; j < count; j++) {
+      if (!memcmp(ids[j], id, sizeof(id))) {
+        lights[i].status = status[j];
+        DEBUG("Light %d restored from cache\n", i);
+      }
+    }
+  }
+}
+
+static void arm_cache_timer() {
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = GW_CACHE_WRITE_MS / 1000;
+  its.it_value.tv_nsec = (GW_CACHE_WRITE_MS % 1000) * 1000000L;
+  timerfd_settime(cache_timer_fd, 0, &its, NULL);
+}
+
+/* Write the status of every light to the cache file, replacing it atomically */
+static void write_cache() {
+  uint8_t snapshot[GVM_SNAPSHOT_LEN(GW_MAX_LIGHTS)];
+  uint8_t ids[GW_MAX_LIGHTS][GVM_SNAPSHOT_ID_LEN];
+  LightStatus status[GW_MAX_LIGHTS];
+
+  for (int i = 0; i < num_lights; i++) {
+    cache_id(&lights[i], ids[i]);
+    status[i] = lights[i].status;
+  }
+  int len = gvm_snapshot_encode(ids, status, num_lights, snapshot, sizeof(snapshot));
+
+  char tmp_path[PATH_MAX];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_path);
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0 || write(fd, snapshot, len) != len || close(fd) || rename(tmp_path, cache_path)) {
+    ERROR("Can't write status cache %s: %s\n", cache_path, strerror(errno));
+    if (fd >= 0)
+      unlink(tmp_path);
+    // Still dirty, try again later
+    arm_cache_timer();
+    return;
+  }
+
+  DEBUG("Wrote status cache\n");
+  cache_dirty = 0;
+}
+
+/* Note a status change, the cache is written GW_CACHE_WRITE_MS after the
+ * first change that isn't written so a busy light doesn't cause a write 
+ * per status report */
+static void cache_changed() {
+  if (!cache_path || cache_dirty)
+    return;
+
+  arm_cache_timer();
+  cache_dirty = 1;
+}
+
+/* Start pacing output to a light if it isn't already running */
+static void light_kick(struct gw_light *l) {
+  if (l->timer_armed || (!l->pending_mask && !l->hello_due))
+    return;
+
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_nsec = 1; // Send the first datagram straight away
+  its.it_interval.tv_sec = pace_ms / 1000;
+  its.it_interval.tv_nsec = (pace_ms % 1000) * 1000000L;
+  timerfd_settime(l->timer_fd, 0, &its, NULL);
+  l->timer_armed = 1;
+}
+
+/* Called every pace interval while a light has output pending, sends
+ * at most one datagram */
+static void light_output(struct gw_light *l) {
+  uint64_t expirations;
+  if (read(l->timer_fd, &expirations, sizeof(expirations)) < 0)
+    return;
+
+  if (l->pending_mask) {
+    int var = l->next_var;
+    while (!(l->pending_mask & (1 << var)))
+      var = (var + 1) % LIGHT_VAR_COUNT;
+    l->next_var = (var + 1) % LIGHT_VAR_COUNT;
+    l->pending_mask &= ~(1 << var);
+
+    char cmd[GVM_SET_CMD_HEX_LEN];
+    gvm_build_set_cmd(var, l->pending_value[var], cmd);
+    DEBUG("Sending var %d = %d, '%.*s'\n", var, l->pending_value[var], (int) sizeof(cmd), cmd);
+    broadcast_udp(l, cmd, sizeof(cmd));
+
+    /* Sometimes the light doesn't acknowledge a set, follow the sets
+     * with a hello so we get a full status update */
+    l->hello_due = 1;
+  } else if (l->hello_due) {
+    DEBUG("Sending hello msg\n");
+    broadcast_udp(l, gvm_hello_msg, strlen(gvm_hello_msg));
+    l->hello_due = 0;
+  } else {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    timerfd_settime(l->timer_fd, 0, &its, NULL);
+    l->timer_armed = 0;
+  }
+}
+
+static void close_client(int idx) {
+  DEBUG("Client %d disconnected\n", idx);
+  close(clients[idx].fd);
+  clients[idx].fd = -1;
+  clients[idx].subscribed = 0;
+}
+
+static int send_msg(int idx, const uint8_t *msg, int len) {
+  /* A client that can't keep up would otherwise miss deltas and hold a
+   * stale view, drop it so it reconnects and resubscribes */
+  if (send(clients[idx].fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL) != len) {
+    ERROR("Client %d not keeping up, dropping it\n", idx);
+    close_client(idx);
+    return -1;
+  }
+  return 0;
+}
+
+/* Append the known values of light_idx in var_mask to a GW_MSG_STATE message */
+static int add_state_vars(uint8_t *msg, int len, int light_idx, int var_mask) {
+  struct gw_hdr *hdr = (struct gw_hdr *) msg;
+  for (int var = 0; var < LIGHT_VAR_COUNT; var++) {
+    int value = *gvm_status_var(&lights[light_idx].status, var);
+    if (!(var_mask & (1 << var)) || value < 0)
+      continue;
+    struct gw_var *v = (struct gw_var *) (msg + len);
+    v->light = light_idx;
+    v->var = var;
+    v->value = value;
+    len += sizeof(*v);
+    hdr->count++;
+  }
+  return len;
+}
+
+/* Add every known value of the lights whose status is (or isn't) confirmed */
+static int add_lights_state(uint8_t *msg, int len, int confirmed) {
+  for (int i = 0; i < num_lights; i++)
+    if (!lights[i].status.confirmed == !confirmed)
+      len = add_state_vars(msg, len, i, (1 << LIGHT_VAR_COUNT) - 1);
+  return len;
+}
+
+static void notify_subscribers(int light_idx, int changed_mask) {
+  uint8_t msg[GW_MAX_MSG_LEN];
+  struct gw_hdr *hdr = (struct gw_hdr *) msg;
+  hdr->type = GW_MSG_STATE;
+  hdr->count = 0;
+  int len = add_state_vars(msg, sizeof(*hdr), light_idx, changed_mask);
+  if (!hdr->count)
+    return;
+
+  for (int i = 0; i < GW_MAX_CLIENTS; i++)
+    if (clients[i].fd != -1 && clients[i].subscribed)
+      send_msg(i, msg, len);
+}
+
+static void read_udp(int light_idx, int fd) {
+  struct gw_light *l = &lights[light_idx];
+  char rx_buffer[2048];
+  int rx_len;
+
+  while ((rx_len = recv(fd, rx_buffer, sizeof(rx_buffer), 0)) >= 0) {
+    int changed = 0;
+    int was_confirmed = l->status.confirmed;
+    int msgs = gvm_parse_msgs(rx_buffer, rx_len, &l->status, &changed);
+    DEBUG("Light %d: %d messages, changed fields 0x%x\n", light_idx, msgs, changed);
+
+    // A pending set that the light now reports is no longer needed
+    for (int var = 0; var < LIGHT_VAR_COUNT; var++)
+      if ((changed & (1 << var)) && l->pending_value[var] == *gvm_status_var(&l->status, var))
+        l->pending_mask &= ~(1 << var);
+
+    if (changed)
+      cache_changed();
+
+    // Subscribers were given the cached values as unconfirmed, confirm them all
+    if (l->status.confirmed && !was_confirmed)
+      changed = (1 << LIGHT_VAR_COUNT) - 1;
+    if (changed)
+      notify_subscribers(light_idx, changed);
+  }
+}
+
+/* Merge a value from a client into the pending output for a light */
+static void set_var(struct gw_light *l, int var, int value) {
+  int min, max;
+  if (gvm_var_range(var, &min, &max))
+    return;
+  if (value < min)
+    value = min;
+  else if (value > max)
+    value = max;
+
+  if (l->status.confirmed && *gvm_status_var(&l->status, var) == value) {
+    // Already what the light reports, nothing to send
+    l->pending_mask &= ~(1 << var);
+    return;
+  }
+
+  l->pending_value[var] = value;
+  l->pending_mask |= 1 << var;
+  light_kick(l);
+}
+
+static void dmx_set_var(int light, int var, int value) {
+  if (light < num_lights)
+    set_var(&lights[light], var, value);
+}
+
+static void handle_client_msg(int idx, const uint8_t *msg, int len) {
+  const struct gw_hdr *hdr = (const struct gw_hdr *) msg;
+  if (len < (int) sizeof(*hdr) || len != (int) (sizeof(*hdr) + hdr->count * sizeof(struct gw_var))) {
+    ERROR("Client %d sent a malformed message of %d bytes\n", idx, len);
+    close_client(idx);
+    return;
+  }
+
+  const struct gw_var *vars = (const struct gw_var *) (msg + sizeof(*hdr));
+  switch (hdr->type) {
+    case GW_MSG_SET:
+      for (int i = 0; i < hdr->count; i++)
+        if (vars[i].light < num_lights)
+          set_var(&lights[vars[i].light], vars[i].var, vars[i].value);
+      break;
+    case GW_MSG_SUBSCRIBE: {
+      uint8_t state[GW_MAX_MSG_LEN];
+      struct gw_hdr *state_hdr = (struct gw_hdr *) state;
+      state_hdr->type = GW_MSG_STATE;
+      state_hdr->count = 0;
+      int state_len = add_lights_state(state, sizeof(*state_hdr), 1);
+      if (send_msg(idx, state, state_len))
+        break;
+
+      state_hdr->type = GW_MSG_CACHED_STATE;
+      state_hdr->count = 0;
+      state_len = add_lights_state(state, sizeof(*state_hdr), 0);
+      if (state_hdr->count && send_msg(idx, state, state_len))
+        break;
+
+      clients[idx].subscribed = 1;
+      break;
+    }
+    case GW_MSG_UNSUBSCRIBE:
+      clients[idx].subscribed = 0;
+      break;
+    case GW_MSG_HELLO:
+      for (int i = 0; i < num_lights; i++) {
+        lights[i].hello_due = 1;
+        light_kick(&lights[i]);
+      }
+      break;
+    default:
+      DEBUG("Client %d sent unknown message type %d\n", idx, hdr->type);
+  }
+}
+
+static void read_client(int idx) {
+  uint8_t msg[GW_MAX_MSG_LEN];
+  int len;
+
+  while (clients[idx].fd != -1 && (len = recv(clients[idx].fd, msg, sizeof(msg), MSG_DONTWAIT)) != 0) {
+    if (len < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        close_client(idx);
+      return;
+    }
+    handle_client_msg(idx, msg, len);
+  }
+
+  if (clients[idx].fd != -1)
+    close_client(idx);
+}
+
+static void accept_clients(int listen_fd) {
+  int fd;
+  while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    int idx = 0;
+    while (idx < GW_MAX_CLIENTS && clients[idx].fd != -1)
+      idx++;
+    if (idx == GW_MAX_CLIENTS || epoll_add(fd, EV_CLIENT, idx)) {
+      ERROR("Too many clients, rejecting connection\n");
+      close(fd);
+      continue;
+    }
+    clients[idx].fd = fd;
+    clients[idx].subscribed = 0;
+    DEBUG("Client %d connected\n", idx);
+  }
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-s socket_path] [-p pace_ms] [-i interface[:broadcast]]... [-a] [-e] [-m light:universe:address[:layout]]...\n"
+          "          [-c cache_file] [-d]\n"
+          "  -s  Unix domain socket to serve clients on (default %s)\n"
+          "  -p  Minimum milliseconds between datagrams sent to a light (default %d)\n"
+          "  -i  Add a lighting network on interface, broadcasting to 255.255.255.255 unless\n"
+          "      an address is given. Networks are lights 0, 1, ... in the order given,\n"
+          "      without any -i there is a single network on all interfaces\n"
+          "  -a  Accept Art-Net DMX on UDP port %d\n"
+          "  -e  Accept sACN (E1.31) DMX on UDP port %d\n"
+          "  -m  Map DMX channels from address (1-512) in universe to a light, layout is\n"
+          "      one letter per channel, o = on/off, c = channel, b = brightness, k = CCT,\n"
+          "      h = hue, s = saturation, - = unused (default %s)\n"
+          "  -c  Keep the last status of the lights in cache_file so it survives a restart\n"
+          "  -d  Print debug messages\n",
+          name, GW_DEFAULT_SOCKET_PATH, GW_DEFAULT_PACE_MS, DMX_ARTNET_PORT, DMX_E131_PORT, DMX_DEFAULT_LAYOUT);
+}
+
+int main(int argc, char **argv) {
+  const char *socket_path = GW_DEFAULT_SOCKET_PATH;
+  int artnet = 0, e131 = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:p:i:aem:c:dh")) != -1) {
+    switch (opt) {
+      case 's':
+        socket_path = optarg;
+        break;
+      case 'p':
+        pace_ms = atoi(optarg);
+        if (pace_ms < 1) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'i':
+        if (num_lights == GW_MAX_LIGHTS || parse_network(&lights[num_lights], optarg)) {
+          ERROR("Invalid or too many networks '%s'\n", optarg);
+          return 1;
+        }
+        num_lights++;
+        break;
+      case 'a':
+        artnet = 1;
+        break;
+      case 'e':
+        e131 = 1;
+        break;
+      case 'm':
+        if (dmx_add_footprint(optarg)) {
+          ERROR("Invalid DMX mapping '%s'\n", optarg);
+          return 1;
+        }
+        break;
+      case 'c':
+        cache_path = optarg;
+        break;
+      case 'd':
+        debugMsgs = 1;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  for (int i = 0; i < GW_MAX_CLIENTS; i++)
+    clients[i].fd = -1;
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigprocmask(SIG_BLOCK, &signals, NULL);
+  int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+  int listen_fd = open_listen_socket(socket_path);
+  if (epoll_fd < 0 || signal_fd < 0 || listen_fd < 0 ||
+      epoll_add(signal_fd, EV_SIGNAL, 0) || epoll_add(listen_fd, EV_LISTEN, 0))
+    return 1;
+
+  if (!num_lights) {
+    lights[0] = gw_light();
+    lights[0].broadcast_addr = INADDR_BROADCAST;
+    num_lights = 1;
+  }
+
+  if (cache_path) {
+    cache_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (cache_timer_fd < 0 || epoll_add(cache_timer_fd, EV_CACHE_TMR, 0))
+      return 1;
+    load_cache();
+  }
+
+  for (int i = 0; i < num_lights; i++) {
+    if (open_light(&lights[i], i))
+      return 1;
+    light_kick(&lights[i]);
+    DEBUG("Light %d on interface '%s'\n", i, lights[i].interface);
+  }
+
+  if (dmx_max_light() >= num_lights) {
+    ERROR("DMX mapping to light %d but there are only %d lights\n", dmx_max_light(), num_lights);
+    return 1;
+  }
+
+  int artnet_fd = artnet ? dmx_open_artnet() : -1;
+  int e131_fd = e131 ? dmx_open_e131() : -1;
+  if ((artnet && (artnet_fd < 0 || epoll_add(artnet_fd, EV_ARTNET, 0))) ||
+      (e131 && (e131_fd < 0 || epoll_add(e131_fd, EV_E131, 0))))
+    return 1;
+
+  DEBUG("Serving clients on %s\n", socket_path);
+
+  int running = 1;
+  while (running) {
+    struct epoll_event events[32];
+    int n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+    if (n < 0 && errno != EINTR) {
+      ERROR("epoll_wait failed: %s\n", strerror(errno));
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      int idx = EV_IDX(events[i].data.u64);
+      switch (EV_KIND(events[i].data.u64)) {
+        case EV_LISTEN:
+          accept_clients(listen_fd);
+          break;
+        case EV_SIGNAL:
+          running = 0;
+          break;
+        case EV_CLIENT:
+          if (clients[idx].fd != -1)
+            read_client(idx);
+          break;
+        case EV_LIGHT_UDP:
+          read_udp(idx, lights[idx].recv_fd);
+          read_udp(idx, lights[idx].send_fd);
+          break;
+        case EV_LIGHT_TMR:
+          light_output(&lights[idx]);
+          break;
+        case EV_ARTNET:
+          dmx_read(artnet_fd, 0, dmx_set_var);
+          break;
+        case EV_E131:
+          dmx_read(e131_fd, 1, dmx_set_var);
+          break;
+        case EV_CACHE_TMR: {
+          uint64_t expirations;
+          if (read(cache_timer_fd, &expirations, sizeof(expirations)) > 0)
+            write_cache();
+          break;
+        }
+      }
+    }
+  }
+
+  DEBUG("Shutting down\n");
+  if (cache_dirty)
+    write_cache();
+  unlink(socket_path);
+  return 0;
+}
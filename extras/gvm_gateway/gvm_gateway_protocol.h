@@ -0,0 +1,62 @@
+/*
+  gvm_gateway_protocol.h - Client protocol for the GVM gateway daemon.
+
+  Clients connect to the gateway over a SOCK_SEQPACKET Unix domain socket,
+  so every send() is exactly one message and no framing is needed. A
+  message is a 2 byte header followed by 'count' variable entries:
+
+    type  (1 byte) - GW_MSG_ value
+    count (1 byte) - Number of gw_var entries that follow
+
+  Each entry is 3 bytes:
+
+    light (1 byte) - Light (network) index on the gateway, 0 for the first
+    var   (1 byte) - LIGHT_VAR_ value from util/GvmProtocol.h
+    value (1 byte) - Raw value as sent to the light (e.g. CCT 44 = 4400k)
+
+  GW_MSG_SET       client -> gateway, batch of values to set. Sets from all
+                   clients are merged, the last value for a variable wins
+  GW_MSG_SUBSCRIBE client -> gateway, the gateway replies with a
+                   GW_MSG_STATE of every value the lights have reported,
+                   followed by a GW_MSG_CACHED_STATE if there are lights
+                   that haven't reported since the gateway started. Then
+                   it sends a GW_MSG_STATE with the changed values whenever
+                   a light reports a change, and with every value of a
+                   light when its first report confirms the cached values
+  GW_MSG_UNSUBSCRIBE client -> gateway, stop receiving state changes
+  GW_MSG_HELLO     client -> gateway, ask the lights to report their status
+  GW_MSG_STATE     gateway -> client, batch of current values
+  GW_MSG_CACHED_STATE gateway -> client, batch of values restored from the
+                   status cache (see -c) that the light hasn't confirmed
+*/
+
+#ifndef GvmGatewayProtocol_h
+#define GvmGatewayProtocol_h
+
+#include <stdint.h>
+
+#define GW_DEFAULT_SOCKET_PATH "/run/gvm_gateway.sock"
+
+#define GW_MSG_SET         1
+#define GW_MSG_SUBSCRIBE   2
+#define GW_MSG_UNSUBSCRIBE 3
+#define GW_MSG_HELLO       4
+#define GW_MSG_STATE       5
+#define GW_MSG_CACHED_STATE 6
+
+#define GW_MAX_VARS        255
+
+struct gw_hdr {
+  uint8_t type;
+  uint8_t count;
+} __attribute__((packed));
+
+struct gw_var {
+  uint8_t light;
+  uint8_t var;
+  uint8_t value;
+} __attribute__((packed));
+
+#define GW_MAX_MSG_LEN (sizeof(struct gw_hdr) + GW_MAX_VARS * sizeof(struct gw_var))
+
+#endif
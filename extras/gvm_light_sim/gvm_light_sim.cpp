@@ -0,0 +1,221 @@
+/*
+  gvm_light_sim.cpp - Simulates GVM lights on a Linux host so the library
+  and the network scheduler can be tested without real lights.
+
+  Each real light is on its own WiFi network, so only one of them can be
+  heard at a time. The simulator holds the state of several lights and
+  answers as the one that is selected, the selection is changed by
+  sending the light's index as a single byte datagram to SIM_SELECT_PORT.
+  A mocked GvmWiFiLayer does this when it "joins" a light's network, see
+  examples/Network_Scheduler_Test.
+
+  Like a real light the simulator applies sets and acknowledges them,
+  answers a hello with a status report and then reports its status
+  every 5 seconds.
+
+  Build with:
+    g++ -O2 -Wall -I../../src -o gvm_light_sim gvm_light_sim.cpp \
+        ../../src/util/GvmProtocol.cpp ../../src/util/HexFunctions.cpp
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "util/GvmProtocol.h"
+#include "util/HexFunctions.h"
+
+static int debugMsgs = 0;
+#define DEBUG(format, ...) if (debugMsgs) { fprintf(stderr, format, ##__VA_ARGS__); };
+#define ERROR(format, ...) fprintf(stderr, format, ##__VA_ARGS__);
+
+#define SIM_SELECT_PORT     2526 // A one byte datagram here selects the light that answers
+#define SIM_MAX_LIGHTS      8
+#define SIM_REPORT_MS       5000 // Lights report their status this often once asked to
+
+#define LIGHT_MSG_HELLO     0x53 // Type of gvm_hello_msg
+
+struct sim_light {
+  uint8_t value[LIGHT_VAR_COUNT]; // Raw values in LIGHT_VAR_ order
+  int reporting;                  // Has been sent a hello, so reports periodically
+};
+
+static struct sim_light lights[SIM_MAX_LIGHTS];
+static int num_lights = 1;
+static int selected = 0;
+static uint32_t broadcast_addr = INADDR_BROADCAST; // Network byte order
+
+static unsigned long now_ms() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+static int open_udp_port(int port) {
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  int yes = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(yes));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+    ERROR("Can't bind UDP port %d: %s\n", port, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Add the CRC to a message in msg and broadcast it as hex to port */
+static void broadcast_msg(int fd, uint8_t *msg, int len, int port) {
+  char hex[64];
+  bytesToHexString(msg, len - 2, hex);
+  unsigned short crc = calcCrcFromHexStr(hex, (len - 2) * 2);
+  shortToHex(crc, hex + (len - 2) * 2);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = broadcast_addr;
+  DEBUG("Light %d sending '%.*s' to port %d\n", selected, len * 2, hex, port);
+  sendto(fd, hex, len * 2, 0, (const struct sockaddr *) &addr, sizeof(addr));
+}
+
+static void send_status(int fd) {
+  uint8_t msg[3 + 3 + LIGHT_VAR_COUNT + 2] = { 'L', 'T', sizeof(msg) - 3, 0x0, 0x30, LIGHT_MSG_VAR_ALL };
+  memcpy(msg + 6, lights[selected].value, LIGHT_VAR_COUNT);
+  broadcast_msg(fd, msg, sizeof(msg), GVM_RECV_PORT);
+}
+
+static void send_var_set(int fd, int var) {
+  uint8_t msg[3 + 3 + 3 + 2] = { 'L', 'T', sizeof(msg) - 3, 0x0, 0x30, LIGHT_MSG_VAR_SET, 0x0 };
+  msg[7] = var;
+  msg[8] = lights[selected].value[var];
+  broadcast_msg(fd, msg, sizeof(msg), GVM_SEND_PORT);
+}
+
+/* Handle a message from a controller, these are set commands or hellos */
+static void handle_msg(int fd, char *hex, int len) {
+  uint8_t msg[32];
+  if (len < (3 + 3 + 2) * 2 || len > (int) sizeof(msg) * 2 || len % 2)
+    return;
+  hexStringToBytes(hex, len, msg);
+
+  // Our own broadcasts come back to us, and other lights' may arrive too
+  if (msg[0] != 'L' || msg[1] != 'T' || msg[2] != len / 2 - 3 ||
+      calcCrcFromHexStr(hex, len - 4) != (msg[len / 2 - 2] << 8 | msg[len / 2 - 1]))
+    return;
+
+  if (msg[5] == LIGHT_MSG_SETVAR && len / 2 >= 3 + 3 + 4 + 2 && msg[7] < LIGHT_VAR_COUNT) {
+    DEBUG("Light %d var %d = %d\n", selected, msg[7], msg[9]);
+    lights[selected].value[msg[7]] = msg[9];
+    send_var_set(fd, msg[7]);
+  } else if (msg[5] == LIGHT_MSG_HELLO) {
+    DEBUG("Light %d hello\n", selected);
+    lights[selected].reporting = 1;
+    send_status(fd);
+  }
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-n lights] [-b broadcast] [-d]\n"
+          "  -n  Number of lights to simulate (default 1, at most %d)\n"
+          "  -b  Address to broadcast to (default 255.255.255.255)\n"
+          "  -d  Print debug messages\n"
+          "Send a light's index as a single byte to UDP port %d to select it\n",
+          name, SIM_MAX_LIGHTS, SIM_SELECT_PORT);
+}
+
+int main(int argc, char **argv) {
+  struct in_addr addr;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:b:dh")) != -1) {
+    switch (opt) {
+      case 'n':
+        num_lights = atoi(optarg);
+        if (num_lights < 1 || num_lights > SIM_MAX_LIGHTS) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'b':
+        if (!inet_aton(optarg, &addr)) {
+          usage(argv[0]);
+          return 1;
+        }
+        broadcast_addr = addr.s_addr;
+        break;
+      case 'd':
+        debugMsgs = 1;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  // Every light starts on, channel 1, 50% brightness, 4400k, hue 0, saturation 0
+  for (int i = 0; i < num_lights; i++) {
+    uint8_t initial[LIGHT_VAR_COUNT] = { 1, 1, 50, 44, 0, 0 };
+    memcpy(lights[i].value, initial, sizeof(initial));
+    lights[i].reporting = 0;
+  }
+
+  int light_fd = open_udp_port(GVM_SEND_PORT);
+  int select_fd = open_udp_port(SIM_SELECT_PORT);
+  if (light_fd < 0 || select_fd < 0)
+    return 1;
+
+  DEBUG("Simulating %d lights\n", num_lights);
+
+  unsigned long last_report = now_ms();
+  for (;;) {
+    struct pollfd fds[] = { { light_fd, POLLIN, 0 }, { select_fd, POLLIN, 0 } };
+    long timeout = SIM_REPORT_MS - (long) (now_ms() - last_report);
+    int n = poll(fds, 2, timeout > 0 ? timeout : 0);
+    if (n < 0 && errno != EINTR) {
+      ERROR("poll failed: %s\n", strerror(errno));
+      return 1;
+    }
+
+    // A selection is sent before the hello to the light, so handle it first
+    if (fds[1].revents & POLLIN) {
+      uint8_t light;
+      if (recv(select_fd, &light, sizeof(light), 0) == 1 && light < num_lights) {
+        DEBUG("Selected light %d\n", light);
+        selected = light;
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      char rx_buffer[2048];
+      int rx_len = recv(light_fd, rx_buffer, sizeof(rx_buffer), 0);
+      if (rx_len > 0)
+        handle_msg(light_fd, rx_buffer, rx_len);
+    }
+
+    if ((long) (now_ms() - last_report) >= SIM_REPORT_MS) {
+      if (lights[selected].reporting)
+        send_status(light_fd);
+      last_report = now_ms();
+    }
+  }
+}
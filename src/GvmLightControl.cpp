@@ -5,6 +5,18 @@
 #include <errno.h>
 #include <StreamString.h>
 #include <esp_vfs_dev.h>
+#include <Preferences.h>
+#if __has_include(<esp_vfs_eventfd.h>)
+#include <esp_vfs_eventfd.h>
+#define GVM_WAKE_EVENTFD // wake() can be called from interrupt handlers
+#endif
+#if CONFIG_PM_ENABLE
+#include <esp_pm.h>
+#include <esp_sleep.h>
+#if __has_include(<esp_idf_version.h>)
+#include <esp_idf_version.h>
+#endif
+#endif
 #include "util/HexFunctions.h"
 #include "GvmLightControl.h"
 
@@ -17,18 +29,9 @@
 #define DISC_EVENT SYSTEM_EVENT_STA_DISCONNECTED
 #endif 
 
-static int debugMsgs = 0;
-#define DEBUG(format, ...) if (debugMsgs) { log_printf(format, ##__VA_ARGS__); };
+#define DEBUG(format, ...) if (debug_msgs) { log_printf(format, ##__VA_ARGS__); };
 
-static int open_udp_port(int *fd, int port);
-
-const char* ssid = "GVM_LED";
-const char* password =  "gvm_admin";
-
-const char* first_connect = "4C5409000053000001009474";
-/* Response msg sometimes   "4C540A00305300000220382B19"  */
-
-static int disconnected = 0;
+GvmLightControl GVM;
 
 inline int set_bounded(int val, int min, int max) {
   if (val < min)
@@ -38,23 +41,56 @@ inline int set_bounded(int val, int min, int max) {
   return val;
 }
 
-GvmLightControl::GvmLightControl(bool debug) {
-  udp_2525_fd = -1;
-  udp_1112_fd = -1;
+GvmLightControl::GvmLightControl(bool debug) : GvmLightControl(GvmLightConfig(), debug) {
+}
+
+GvmLightControl::GvmLightControl(const GvmLightConfig &config, bool debug) : config(config) {
+  debug_msgs = 0;
+  disconnected = 0;
+  disconnect_event = 0;
+  rx_buffer = NULL;
+  status_millis = 0;
+  cache_count = 0;
+  cache_loaded = 0;
+  cache_dirty = 0;
+  cache_dirty_millis = 0;
+  udp_send_fd = -1;
+  udp_recv_fd = -1;
+  wake_fd = -1;
+  wake_port = 0;
+  cpu_mhz = 0;
   onWiFiConnectAttempt = NULL;
   onStatusUpdated = NULL;
   if (debug) 
     debugOn();
+
+  // NVS isn't ready while global constructors run, a global instance 
+  // loads the cache on first use instead
+  if (xTaskGetSchedulerState() == taskSCHEDULER_RUNNING)
+    load_state_cache();
+}
+
+GvmLightControl::~GvmLightControl() {
+  flushStateCache();
+  if (disconnect_event)
+    WiFi.removeEvent(disconnect_event);
+  int fds[] = { udp_send_fd, udp_recv_fd, wake_fd };
+  for (int i = 0; i < (int) (sizeof(fds) / sizeof(fds[0])); i++)
+    if (fds[i] != -1)
+      close(fds[i]);
+  free(rx_buffer);
 }
 
 void GvmLightControl::debugOn() {
-  debugMsgs = 1;
+  debug_msgs = 1;
 }
 
 void GvmLightControl::callbackOnWiFiConnectAttempt(void (*callback)(uint8_t *bssid, int attempt)) {
   onWiFiConnectAttempt = callback;
 }
 
+/* The callback is called for each status report or set ack from the
+ * light, whether or not it changed the status */
 void GvmLightControl::callbackOnStatusUpdated(void (*callback)()) {
   onStatusUpdated = callback;
 }
@@ -62,7 +98,7 @@ void GvmLightControl::callbackOnStatusUpdated(void (*callback)()) {
 // Show all networks available. Technically the doc says this can 
 // only be called once you're connected, but that doesn't seem to be
 // true
-static void scan_wifi_networks() {
+void GvmLightControl::scan_wifi_networks() {
   // WiFi.scanNetworks will return the number of networks found
   int n = WiFi.scanNetworks();
   DEBUG("Scan done\n");
@@ -81,7 +117,7 @@ static void scan_wifi_networks() {
   DEBUG("");  
 }
 
-static void clear_wifi() {
+void GvmLightControl::clear_wifi() {
   DEBUG("Resetting WiFi, current status %d (from core %d)\n", WiFi.status(), xPortGetCoreID());
   WiFi.disconnect(true, true); // Switch off WiFi and forget any AP config
   WiFi.persistent(false);
@@ -99,26 +135,26 @@ void WiFiEvents(WiFiEvent_t event, WiFiEventInfo_t info) {
   /* Not safe for writes from task callback */
 }
 
-void WiFiStationDisconnected(WiFiEvent_t event, WiFiEventInfo_t info) {
-  // Handling function code
-  disconnected = 1;
-}
-
 void GvmLightControl::process_messages() {
-  read_udp(udp_1112_fd);
-  read_udp(udp_2525_fd);
+  read_udp(udp_recv_fd);
+  read_udp(udp_send_fd);
+  write_behind();
 }
 
 int GvmLightControl::find_and_join_light_wifi(int *networks_found) {
   if (networks_found)
     *networks_found = 0;
 
+  load_state_cache();
+
   DEBUG("Initializing WiFi\n");
   
   WiFi.mode(WIFI_MODE_STA);
   DEBUG("Mode set to station\n");
 
-  WiFi.onEvent(WiFiStationDisconnected, DISC_EVENT);
+  // Each instance watches for its own failed connection attempts
+  if (!disconnect_event)
+    disconnect_event = WiFi.onEvent([this](WiFiEvent_t event, WiFiEventInfo_t info) { disconnected = 1; }, DISC_EVENT);
   // WiFi.onEvent(WiFiEvents, SYSTEM_EVENT_MAX);
 
   // First try to connect to any remembered AP
@@ -145,11 +181,12 @@ int GvmLightControl::find_and_join_light_wifi(int *networks_found) {
                   i + 1, WiFi.SSID(i).c_str(), WiFi.RSSI(i), WiFi.BSSIDstr(i).c_str(), WiFi.channel(i), 
                   WiFi.encryptionType(i) == WIFI_AUTH_OPEN?" ":"*");
                   
-    if (strcmp(WiFi.SSID(i).c_str(), ssid))
+    if (strcmp(WiFi.SSID(i).c_str(), config.ssid))
       continue;
 
-    (*networks_found)++;
-    if (!try_connect_wifi(WiFi.SSID(i).c_str(), password, WiFi.channel(i), WiFi.BSSID(i)))
+    if (networks_found)
+      (*networks_found)++;
+    if (!try_connect_wifi(WiFi.SSID(i).c_str(), config.password, WiFi.channel(i), WiFi.BSSID(i)))
       return 0;
   }
 
@@ -165,6 +202,8 @@ int GvmLightControl::try_connect_wifi(const char *ssid, const char *password, in
   while (connection_attempts++ < 2) {
     DEBUG("Updating connection info on screen\n");
 
+    // So the callback can show what we last knew about this light
+    select_cached_device(bssid);
     if (onWiFiConnectAttempt)
       onWiFiConnectAttempt(bssid, connection_attempts);
       /*
@@ -221,30 +260,47 @@ int GvmLightControl::try_connect_wifi(const char *ssid, const char *password, in
   return -1;
 }
 
+/* Open the sockets on the network we're joined to and ask the light to 
+ * report, returns 0 once it has sent its status */
 int GvmLightControl::test_light_connection() {
   DEBUG("Connected to the WiFi network. IP: ");
   // DEBUG(WiFi.localIP());
   DEBUG("Base station is: %s\n", WiFi.BSSIDstr().c_str());
   DEBUG("Receive strength is: %d\n", WiFi.RSSI());
 
-  // Listen on any incoming IP address for UDP port 2525
-  // udp.begin(2525);
-  open_udp_port(&udp_2525_fd, 2525);
-  DEBUG("Listening port 2525 with FD %d\n", udp_2525_fd);
+  if (!rx_buffer)
+    rx_buffer = (unsigned char *) malloc(config.rx_buffer_size);
+
+  // Listen on any incoming IP address for the send and status ports
+  if (open_udp_port(&udp_send_fd, config.send_port) < 0)
+    return -1;
+  DEBUG("Listening port %d with FD %d\n", config.send_port, udp_send_fd);
+
+  if (open_udp_port(&udp_recv_fd, config.recv_port) < 0)
+    return -1;
+  DEBUG("Listening port %d with FD %d\n", config.recv_port, udp_recv_fd);
 
-  open_udp_port(&udp_1112_fd, 1112);
-  DEBUG("Listening port 1112 with FD %d\n", udp_1112_fd);
+  open_wake_port();
+  DEBUG("Wake events on loopback port %d with FD %d\n", wake_port, wake_fd);
+
+  // Start from what we last knew about this light until it reports
+  select_cached_device(WiFi.BSSID());
 
   // Broadcast the starting message to ask the light(s) to report 
   DEBUG("Broadcasting first connect message\n");
+  light_status.confirmed = 0;
   send_hello_msg();
 
-  DEBUG("Waiting for light message\n");
+  /* Wait for a status report. Other messages, e.g. the light's reply to
+   * the hello or our own hello coming back, don't say what the light has */
+  DEBUG("Waiting for light status\n");
   
   int waits = 60;
   while (waits-- >= 0) {
-    if (read_udp(udp_1112_fd)) {
-      DEBUG("Received light message, proceeding\n");
+    read_udp(udp_recv_fd);
+    read_udp(udp_send_fd);
+    if (light_status.confirmed) {
+      DEBUG("Received light status, proceeding\n");
       return 0;
     }
     delay(20); 
@@ -256,18 +312,34 @@ int GvmLightControl::test_light_connection() {
 int GvmLightControl::broadcast_udp(const void *d, int len) {
   struct sockaddr_in broadcast_addr;
   broadcast_addr.sin_family = AF_INET;
-  broadcast_addr.sin_port = htons(2525);
-  broadcast_addr.sin_addr.s_addr = INADDR_BROADCAST;    
-  return sendto(udp_2525_fd, d, len, 0, (const sockaddr *) &broadcast_addr, sizeof(broadcast_addr));   
+  broadcast_addr.sin_port = htons(config.send_port);
+  broadcast_addr.sin_addr.s_addr = htonl(config.broadcast_addr);    
+  return sendto(udp_send_fd, d, len, 0, (const sockaddr *) &broadcast_addr, sizeof(broadcast_addr));   
 }
 
-static int open_udp_port(int *fd, int port) {
+int GvmLightControl::open_udp_port(int *fd, int port) {
   if (*fd != -1)
     close(*fd);
   *fd = socket(AF_INET, SOCK_DGRAM, 0);
 
   int yes = 1;
   setsockopt(*fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+#ifdef SO_BINDTODEVICE
+  // Only send and receive on the configured network
+  if (config.interface) {
+    struct ifreq ifr;
+    memset((char *) &ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, config.interface, sizeof(ifr.ifr_name) - 1);
+    if (setsockopt(*fd, SOL_SOCKET, SO_BINDTODEVICE, &ifr, sizeof(ifr))) {
+      // Unbound the socket would talk to whichever light's network the station is on
+      DEBUG("Can't bind FD %d to interface %s, errno %d\n", *fd, config.interface, errno);
+      close(*fd);
+      *fd = -1;
+      return -1;
+    }
+  }
+#endif
   
   struct sockaddr_in addr;
   memset((char *) &addr, 0, sizeof(addr));
@@ -285,31 +357,61 @@ static int open_udp_port(int *fd, int port) {
   return *fd; 
 }
 
-// CRC-16/XMODEM, see https://crccalc.com/ or https://www.tahapaksu.com/crc/
-uint16_t calcCrcFromHexStr(const char *str, int len) {
-  uint16_t crc = 0;
-  unsigned char c;
-  while (len >= 2) {
-    // DEBUG("CRC calc %c%c = ", *(str), *(str + 1));
-    c = (charToVal(*str++) << 4);
-    c += charToVal(*str++);
-    crc ^= c << 8;
-    for (int i = 0; i < 8; i++) {
-      if (crc & 0x8000)
-        crc = (crc << 1) ^ 0x1021;
-      else
-        crc = crc << 1;
-    }   
-    len -= 2; 
-    // DEBUG("%x CRC = %d\n", c, crc);
-  }
-  return crc & 0xFFFF;  
+/* An FD that wake() signals, so a task or interrupt handler can 
+ * interrupt the select() in wait_until. Where the SDK has eventfd it's
+ * used as it can be written from an ISR, otherwise a loopback socket */
+int GvmLightControl::open_wake_port() {
+  if (wake_fd != -1)
+    return wake_fd;
+
+#ifdef GVM_WAKE_EVENTFD
+  // Registering again fails harmlessly if another instance already has
+  esp_vfs_eventfd_config_t eventfd_config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+  esp_vfs_eventfd_register(&eventfd_config);
+  wake_fd = eventfd(0, EFD_SUPPORT_ISR);
+  if (wake_fd == -1)
+    DEBUG("Can't create wake eventfd, errno %d\n", errno);
+  return wake_fd;
+#else
+  wake_fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  memset((char *) &addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = 0; // Any free port
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bind(wake_fd, (struct sockaddr*) &addr, sizeof(addr));
+  getsockname(wake_fd, (struct sockaddr*) &addr, &addr_len);
+  wake_port = ntohs(addr.sin_port);
+
+  fcntl(wake_fd, F_SETFL, O_NONBLOCK);
+
+  return wake_fd;
+#endif
 }
 
 LightStatus GvmLightControl::getLightStatus() {
+  load_state_cache();
   return light_status;
 }
 
+/* Replace the known status, e.g. with a cached status when switching 
+ * to another light's network. It isn't confirmed until the light reports */
+void GvmLightControl::setLightStatus(const LightStatus &status) {
+  light_status = status;
+  light_status.confirmed = 0;
+}
+
+/* millis() when the light last reported its status, 0 if it never has */
+unsigned long GvmLightControl::getStatusMillis() {
+  return status_millis;
+}
+
+const GvmLightConfig &GvmLightControl::getConfig() {
+  return config;
+}
+
 int GvmLightControl::getOnOff() {
   return light_status.on_off;
 }
@@ -381,18 +483,16 @@ int GvmLightControl::read_udp(int fd) {
   int rx_len;
   int rx_from_size;
   struct sockaddr_in rx_from;
-  unsigned char rx_buffer[2048] = {'\0'}; 
+
+  if (fd == -1 || !rx_buffer)
+    return 0;
   
   rx_from_size = sizeof(rx_from);
   memset((char *) &rx_from, 0, sizeof(rx_from));
   
-  unsigned char decodeBuffer[sizeof(rx_buffer) / 2] = {'\0'}; 
-  unsigned char *msgDecode = rx_buffer;
-  unsigned char *hexDecode = decodeBuffer;
-
   // DEBUG("Reading %d\n",fd);
   
-  while ((rx_len = recvfrom(fd, rx_buffer, sizeof(rx_buffer) - 1, 0, (sockaddr *) &rx_from, (socklen_t *) &rx_from_size)) > -1) {
+  while ((rx_len = recvfrom(fd, rx_buffer, config.rx_buffer_size - 1, 0, (sockaddr *) &rx_from, (socklen_t *) &rx_from_size)) > -1) {
     rx_buffer[rx_len] = '\0';
     DEBUG("Received packet on FD %d\n", fd);
     DEBUG("From %d.%d.%d.%d:%d\n", 
@@ -405,87 +505,27 @@ int GvmLightControl::read_udp(int fd) {
     // serialPrintAsHex((char *) rx_buffer, rx_len, "Message: ");
     DEBUG("%s", printAsHex((char *) rx_buffer, rx_len, "Message: ").c_str());
     
-    // The message from the GVM lights is bytes encoded as a hex string, decode first 
-    hexStringToBytes((char *) rx_buffer, rx_len, (unsigned char *) decodeBuffer);
-
-    hexDecode = decodeBuffer;
-    msgDecode = rx_buffer; 
-
-    while (rx_len >= (3 * 2) && 
-           hexDecode[0] == 'L' /* 0x4C */ && 
-           hexDecode[1] == 'T' /* 0x54 */ && 
-           hexDecode[2] <= rx_len / 2 - 3) {
-      int msglen = 3 + hexDecode[2];
-      
-      /* Might be a GVM light message, check the CRC */
-      DEBUG("Calc CRC for message of length %d == %d\n", hexDecode[2], (2 * (3 + hexDecode[2] - 2)));
-      unsigned short crc = calcCrcFromHexStr((char *) msgDecode, (2 * (3 + hexDecode[2] - 2)));
-      unsigned short msgcrc = ntohs(*((unsigned short *) &hexDecode[3 + hexDecode[2] - 2]));
-
-      /* If this is not a light message stop decoding */
-      if (crc != msgcrc) {
-        DEBUG("CRC not correct, %d vs %d\n", crc, msgcrc);
-        break;
-      }
-
-      msgs_processed++;
-      
-      DEBUG("GVM light message with %d bytes of payload\n", hexDecode[2]);
-      DEBUG("  Length %d\n  Device ID %d\n  Device Type 0x%x\n  Message Type %d\n",
-                    hexDecode[2], hexDecode[3], hexDecode[4], hexDecode[5]);
-                        
-      if (hexDecode[5] == LIGHT_MSG_VAR_ALL) {
-        /* Status message sent periodically by the lights */
-        /* Save state */
-        light_status.on_off     = hexDecode[6]; // 0 if light is currently 'soft' off, 1 if it's on
-        light_status.channel    = hexDecode[7];
-        light_status.brightness = hexDecode[8];
-        light_status.cct        = hexDecode[9];
-        light_status.hue        = hexDecode[10];
-        light_status.saturation = hexDecode[11];
-        DEBUG("  Status Message: Light On %d Channel %d Brightness %d%% CCT %d Hue %d Saturation %d\n",
-                      hexDecode[6], hexDecode[7] - 1, hexDecode[8], hexDecode[9] * 100, hexDecode[10] * 5, hexDecode[11]);
-        if (onStatusUpdated)
-          onStatusUpdated();
-      } else if (hexDecode[5] == LIGHT_MSG_VAR_SET) {
-        /* Updated message, send in response to an update message 
-        e.g '4C54080030020002003A89' received from sending a brightness zero message '4C5409003057000201005C9E'
-        or  '4C54080030020002030AEA' received from sending a brightness 3% message   '4C5409003057000201036CFD' */
-        DEBUG("  Updated Message: Unknown 1 %d Field %d Value %d\n", 
-                      hexDecode[6], hexDecode[7], hexDecode[8]);
-        switch (hexDecode[7]) {
-          case LIGHT_VAR_ON_OFF:
-            light_status.on_off = hexDecode[8];
-            break;
-          case LIGHT_VAR_CHANNEL:
-            light_status.channel = hexDecode[8];
-            break;
-          case LIGHT_VAR_BRIGHTNESS:
-            light_status.brightness = hexDecode[8];
-            break;
-          case LIGHT_VAR_CCT:
-            light_status.cct = hexDecode[8];
-            break;
-          case LIGHT_VAR_HUE:
-            light_status.hue = hexDecode[8];
-            break;
-          case LIGHT_VAR_SATURATION:
-            light_status.saturation = hexDecode[8];
-            break;            
-        }
-        if (onStatusUpdated)
-          onStatusUpdated();
-      } else {
-        DEBUG("  Unknown Payload: %.*s\n", (hexDecode[2] - 3 - 2) * 2, msgDecode + ((3 + 3) * 2)); // FIX not being at start of rxbuffer        
-      }
-
-      rx_len -= msglen * 2;
-      hexDecode += msglen;
-      msgDecode += msglen * 2;
-      DEBUG("RX left %d\n", rx_len);
-      if (rx_len >= 6)
-        DEBUG("First bytes of potential next message = %02x %02x %02x\n", hexDecode[0], hexDecode[1], hexDecode[2]);
-    }
+    // The message from the GVM lights is bytes encoded as a hex string
+    int changed = 0;
+    int reports = 0;
+    int was_confirmed = light_status.confirmed;
+    int msgs = gvm_parse_msgs((char *) rx_buffer, rx_len, &light_status, &changed, &reports);
+    msgs_processed += msgs;
+    if (reports)
+      status_millis = millis();
+
+    DEBUG("  %d light messages, changed fields 0x%x\n", msgs, changed);
+    DEBUG("  Status: Light On %d Channel %d Brightness %d%% CCT %d Hue %d Saturation %d\n",
+                  light_status.on_off, light_status.channel - 1, light_status.brightness, 
+                  light_status.cct * 100, light_status.hue * 5, light_status.saturation);
+
+    if (changed || light_status.confirmed != was_confirmed)
+      update_state_cache();
+
+    // Every status report and set ack is passed on, an unchanged one still
+    // tells the application the light is there
+    for (int i = 0; i < reports && onStatusUpdated; i++)
+      onStatusUpdated();
   }
 
   return msgs_processed;
@@ -496,11 +536,11 @@ int GvmLightControl::read_udp(int fd) {
  * will continue to be sent every 5 seconds 
  */
 int GvmLightControl::send_hello_msg() {
-  if (udp_2525_fd == -1)
+  if (udp_send_fd == -1)
     return -1;
 
-  DEBUG("Sending hello msg, '%.*s'\n", strlen(first_connect), first_connect);
-  int rc = broadcast_udp(first_connect, strlen(first_connect));
+  DEBUG("Sending hello msg, '%.*s'\n", strlen(gvm_hello_msg), gvm_hello_msg);
+  int rc = broadcast_udp(gvm_hello_msg, strlen(gvm_hello_msg));
 
   return 0;
 }
@@ -521,27 +561,12 @@ int GvmLightControl::send_set_cmd_and_hello(uint8_t setting, uint8_t value) {
 }
 
 int GvmLightControl::send_set_cmd(uint8_t setting, uint8_t value) {
-  if (udp_2525_fd == -1)
+  if (udp_send_fd == -1)
     return -1;
 
-  unsigned char cmd_buffer[3 + 3 + 4 + 2];
-  char encoded_cmd_buffer[sizeof(cmd_buffer) * 2]; 
-
-  /* Example to turn light off '4C5409003057000201005C9E' */
-  cmd_buffer[0] = 'L';
-  cmd_buffer[1] = 'T';
-  cmd_buffer[2] = sizeof(cmd_buffer) - 3;
-  cmd_buffer[3] = 0x0;
-  cmd_buffer[4] = 0x30;
-  cmd_buffer[5] = LIGHT_MSG_SETVAR;
-  cmd_buffer[6] = 0x0;
-  cmd_buffer[7] = setting;
-  cmd_buffer[8] = 0x1;
-  cmd_buffer[9] = value;
-
-  bytesToHexString(cmd_buffer, sizeof(cmd_buffer) - 2, encoded_cmd_buffer);
-  unsigned short crc = calcCrcFromHexStr(encoded_cmd_buffer, (sizeof(cmd_buffer) - 2) * 2);
-  shortToHex(crc, encoded_cmd_buffer + sizeof(encoded_cmd_buffer) - 4);
+  char encoded_cmd_buffer[GVM_SET_CMD_HEX_LEN]; 
+
+  gvm_build_set_cmd(setting, value, encoded_cmd_buffer);
   
   DEBUG("Sending command with len %d, '%.*s'\n", sizeof(encoded_cmd_buffer), sizeof(encoded_cmd_buffer), encoded_cmd_buffer);
 
@@ -549,17 +574,264 @@ int GvmLightControl::send_set_cmd(uint8_t setting, uint8_t value) {
   return 0;
 }
 
+/* The last status of each light is kept in NVS so the UI can show it 
+ * straight away on the next boot, marked as unconfirmed until the 
+ * light reports */
+void GvmLightControl::load_state_cache() {
+  if (cache_loaded || !config.state_cache)
+    return;
+  cache_loaded = 1;
+
+  uint8_t snapshot[GVM_SNAPSHOT_LEN(GVM_CACHE_DEVICES)];
+  Preferences prefs;
+  if (!prefs.begin(config.state_cache, true)) {
+    DEBUG("No status cache '%s'\n", config.state_cache);
+    return;
+  }
+  size_t len = prefs.getBytes("status", snapshot, sizeof(snapshot));
+  prefs.end();
+
+  int count = gvm_snapshot_decode(snapshot, len, cache_ids, cache_status, GVM_CACHE_DEVICES);
+  DEBUG("Loaded %d cached light status from %d bytes\n", count, len);
+  if (count < 0)
+    return;
+  cache_count = count;
+
+  // Until a light reports show the last one we heard from
+  if (cache_count && !light_status.confirmed)
+    light_status = cache_status[0];
+}
+
+static int same_status(LightStatus *a, LightStatus *b) {
+  for (int var = 0; var < LIGHT_VAR_COUNT; var++)
+    if (*gvm_status_var(a, var) != *gvm_status_var(b, var))
+      return 0;
+  return 1;
+}
+
+/* Record the status of the light we're connected to, write_behind writes
+ * it to flash cache_write_millis after the first change that isn't written */
+void GvmLightControl::update_state_cache() {
+  if (!config.state_cache)
+    return;
+  load_state_cache();
+
+  uint8_t *bssid = WiFi.BSSID();
+  if (!bssid)
+    return;
+
+  int i = 0;
+  while (i < cache_count && memcmp(cache_ids[i], bssid, GVM_SNAPSHOT_ID_LEN))
+    i++;
+  if (i == 0 && cache_count && same_status(&cache_status[0], &light_status))
+    return;
+  if (i == cache_count) {
+    // New light, drop the one heard from longest ago if full
+    if (cache_count < GVM_CACHE_DEVICES)
+      cache_count++;
+    else
+      i--;
+  }
+
+  // Most recent first so the next boot starts with this light
+  memmove(cache_ids[1], cache_ids[0], i * sizeof(cache_ids[0]));
+  for (; i > 0; i--)
+    cache_status[i] = cache_status[i - 1];
+  memcpy(cache_ids[0], bssid, GVM_SNAPSHOT_ID_LEN);
+  cache_status[0] = light_status;
+
+  if (!cache_dirty) {
+    cache_dirty = 1;
+    cache_dirty_millis = millis();
+  }
+}
+
+/* Switch to the cached status of a light when we join its network, or
+ * to an unknown status if it isn't cached. The status we hold may be 
+ * another light's, so this always looks the light up */
+void GvmLightControl::select_cached_device(const uint8_t *bssid) {
+  if (!bssid)
+    return;
+
+  LightStatus cached;
+  if (getCachedStatus(bssid, &cached))
+    cached = LightStatus();
+  light_status = cached;
+}
+
+/* Get the last known status of the light with network BSSID, returns -1 
+ * if it's not known */
+int GvmLightControl::getCachedStatus(const uint8_t *bssid, LightStatus *status) {
+  load_state_cache();
+  for (int i = 0; i < cache_count; i++) {
+    if (!memcmp(cache_ids[i], bssid, GVM_SNAPSHOT_ID_LEN)) {
+      *status = cache_status[i];
+      status->confirmed = 0;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+void GvmLightControl::write_behind() {
+  if (cache_dirty && millis() - cache_dirty_millis >= config.cache_write_millis)
+    flushStateCache();
+}
+
+/* Write any cached status changes to flash now, e.g. before powering off */
+void GvmLightControl::flushStateCache() {
+  if (!cache_dirty)
+    return;
+
+  uint8_t snapshot[GVM_SNAPSHOT_LEN(GVM_CACHE_DEVICES)];
+  int len = gvm_snapshot_encode(cache_ids, cache_status, cache_count, snapshot, sizeof(snapshot));
+
+  Preferences prefs;
+  size_t written = 0;
+  if (len >= 0 && prefs.begin(config.state_cache, false)) {
+    written = prefs.putBytes("status", snapshot, len);
+    prefs.end();
+  }
+  DEBUG("Wrote %d of %d bytes of light status cache\n", written, len);
+
+  // Still dirty after a failed write, write_behind tries again later
+  if (len < 0 || written != (size_t) len) {
+    cache_dirty_millis = millis();
+    return;
+  }
+  cache_dirty = 0;
+}
+
 int GvmLightControl::wait_msg_or_timeout() {
-  fd_set readSet;
-  struct timeval t;
-  t.tv_sec = 0;
-  t.tv_usec = 10000;
-  FD_ZERO(&readSet);
-  FD_SET(udp_1112_fd, &readSet);
-  int rc = select(udp_1112_fd + 1, &readSet, NULL, NULL, &t);    
-  if (rc < 0)
-    DEBUG("Wait on FD %d returned %d\n", udp_1112_fd, rc);
-  if (rc == 1)
-    process_messages();
+  wait_until(millis() + 10);
   return 0;
 }
+
+/* Block until a message from the lights arrives, wake() is called or 
+ * millis() reaches deadline. Rather than polling the task sleeps in 
+ * select(), so the CPU can idle (and light sleep, see setPowerSave) 
+ * for as long as the application has nothing to do. Returns the number
+ * of light messages processed, 0 if the deadline passed or wake() was
+ * called */
+int GvmLightControl::wait_until(unsigned long deadline) {
+  write_behind();
+  open_wake_port();
+
+  long remaining;
+  while ((remaining = (long) (deadline - millis())) > 0) {
+    fd_set readSet;
+    int max_fd = -1;
+    FD_ZERO(&readSet);
+    int fds[] = { udp_recv_fd, udp_send_fd, wake_fd };
+    for (int i = 0; i < (int) (sizeof(fds) / sizeof(fds[0])); i++) {
+      if (fds[i] == -1)
+        continue;
+      FD_SET(fds[i], &readSet);
+      if (fds[i] > max_fd)
+        max_fd = fds[i];
+    }
+
+    // No sockets and no wake FD, nothing can interrupt the wait
+    if (max_fd == -1) {
+      delay(remaining);
+      return 0;
+    }
+
+    struct timeval t;
+    t.tv_sec = remaining / 1000;
+    t.tv_usec = (remaining % 1000) * 1000;
+    int rc = select(max_fd + 1, &readSet, NULL, NULL, &t);
+    if (rc < 0) {
+      DEBUG("Wait returned %d, errno %d\n", rc, errno);
+      return -1;
+    }
+    if (rc == 0)
+      return 0;
+
+    int woken = wake_fd != -1 && FD_ISSET(wake_fd, &readSet);
+    if (woken) {
+#ifdef GVM_WAKE_EVENTFD
+      // Reading returns the count of wake() calls and resets it
+      uint64_t wakes;
+      read(wake_fd, &wakes, sizeof(wakes));
+#else
+      char wake_buffer[16];
+      while (recv(wake_fd, wake_buffer, sizeof(wake_buffer), 0) > 0)
+        ;
+#endif
+    }
+
+    int msgs = 0;
+    if (udp_recv_fd != -1 && FD_ISSET(udp_recv_fd, &readSet))
+      msgs += read_udp(udp_recv_fd);
+    if (udp_send_fd != -1 && FD_ISSET(udp_send_fd, &readSet))
+      msgs += read_udp(udp_send_fd);
+
+    // Anything else wasn't a light message, keep waiting
+    if (msgs || woken)
+      return msgs;
+  }
+
+  return 0;
+}
+
+/* Interrupt a wait_until in progress, or make the next one return at 
+ * once. Can be called from any task, and from an interrupt handler 
+ * where the SDK has eventfd (ESP-IDF 4.4 and later) */
+void IRAM_ATTR GvmLightControl::wake() {
+  if (wake_fd == -1)
+    return;
+
+#ifdef GVM_WAKE_EVENTFD
+  uint64_t one = 1;
+  write(wake_fd, &one, sizeof(one));
+#else
+  struct sockaddr_in addr;
+  memset((char *) &addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(wake_port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  char c = 0;
+  sendto(wake_fd, &c, 1, 0, (const sockaddr *) &addr, sizeof(addr));
+#endif
+}
+
+/* Modem sleep switches the radio off between DTIM beacons. The AP 
+ * buffers broadcasts (which is how the lights report status) until 
+ * the DTIM so none are missed, and sends wake the radio immediately. 
+ * If power management is enabled in the SDK config the CPU clock is 
+ * also scaled down and, where tickless idle is available, the chip 
+ * light sleeps while blocked in wait_until. GPIO edge interrupts don't
+ * fire in light sleep, pins that should wake the chip must be armed
+ * with gpio_wakeup_enable() for the level that wakes it */
+void GvmLightControl::setPowerSave(bool enable) {
+  esp_err_t rc = esp_wifi_set_ps(enable ? WIFI_PS_MIN_MODEM : WIFI_PS_NONE);
+  DEBUG("WiFi power save %d, rc %d\n", enable, rc);
+
+#if CONFIG_PM_ENABLE
+#if defined(ESP_IDF_VERSION_MAJOR) && ESP_IDF_VERSION_MAJOR >= 5
+  esp_pm_config_t pm;
+#else
+  esp_pm_config_esp32_t pm;
+#endif
+  // Keep the clock the application runs at (which setCpuFrequencyMhz may 
+  // have changed) as the maximum, read before power management scales it
+  if (!cpu_mhz)
+    cpu_mhz = getCpuFrequencyMhz();
+  pm.max_freq_mhz = cpu_mhz;
+  pm.min_freq_mhz = enable ? getXtalFrequencyMhz() : pm.max_freq_mhz;
+  pm.light_sleep_enable = enable;
+  rc = esp_pm_configure(&pm);
+  if (rc != ESP_OK && enable) {
+    // Light sleep needs tickless idle, fall back to just scaling the clock
+    pm.light_sleep_enable = false;
+    rc = esp_pm_configure(&pm);
+  }
+  if (rc == ESP_OK && pm.light_sleep_enable)
+    esp_sleep_enable_gpio_wakeup();
+  DEBUG("Power management min %d MHz max %d MHz light sleep %d, rc %d\n", 
+        pm.min_freq_mhz, pm.max_freq_mhz, pm.light_sleep_enable, rc);
+  if (!enable)
+    cpu_mhz = 0;
+#endif
+}
@@ -7,7 +7,9 @@
 #ifndef GvmLightControl_h
 #define GvmLightControl_h
 
+#include <WiFi.h>
 #include "util/HexFunctions.h"
+#include "util/GvmProtocol.h"
 
 /* Messages are sent to the lights with UDP broadcast to 255.255.255.255:2525.
  * Messages are received from the lights with UDP broadcast to 255.255.255.255:1112
@@ -70,40 +72,49 @@
 
 #define LOG_CHANNEL "gvm_lights"
 
-#define LIGHT_VAR_ON_OFF     0
-#define LIGHT_VAR_CHANNEL    1
-#define LIGHT_VAR_BRIGHTNESS 2
-#define LIGHT_VAR_CCT        3
-#define LIGHT_VAR_HUE        4
-#define LIGHT_VAR_SATURATION 5
+#define GVM_DEFAULT_SSID          "GVM_LED"
+#define GVM_DEFAULT_PASSWORD      "gvm_admin"
+#define GVM_DEFAULT_RX_BUFFER     2048
+#define GVM_DEFAULT_STATE_CACHE   "gvm_cache"
+#define GVM_DEFAULT_CACHE_WRITE   10000 // Milliseconds to batch status changes before writing to flash
+#define GVM_CACHE_DEVICES         8     // Number of lights whose last status is kept
 
-#define LIGHT_MSG_SETVAR     0x57 // Send to set a variable 
-#define LIGHT_MSG_VAR_SET    0x2  // Response to a variable set
-#define LIGHT_MSG_VAR_ALL    0x3  // Periodic message with all variable settings    
-
-uint16_t calcCrcFromHexStr(const char *str, int len);
-
-class LightStatus {
+/* Everything that identifies the lighting network an instance talks to. 
+ * The strings are not copied and must outlive the instance */
+class GvmLightConfig {
   public:
-    LightStatus() : on_off(-1), channel(-1), hue(-1), brightness(-1), cct(-1), saturation(-1) {};
+    GvmLightConfig() : ssid(GVM_DEFAULT_SSID), password(GVM_DEFAULT_PASSWORD), 
+                       send_port(GVM_SEND_PORT), recv_port(GVM_RECV_PORT), 
+                       broadcast_addr(0xFFFFFFFF), interface(NULL), 
+                       rx_buffer_size(GVM_DEFAULT_RX_BUFFER), 
+                       state_cache(GVM_DEFAULT_STATE_CACHE), 
+                       cache_write_millis(GVM_DEFAULT_CACHE_WRITE) {};
 
-  public: 
-    int on_off;
-    int channel;
-    int hue;
-    int brightness;
-    int cct;
-    int saturation;    
+  public:
+    const char *ssid;        // SSID of the lights' networks
+    const char *password;
+    uint16_t send_port;      // Port the lights listen on
+    uint16_t recv_port;      // Port the lights broadcast status to
+    uint32_t broadcast_addr; // Broadcast address in host byte order, e.g. 0xC0A804FF for 192.168.4.255
+    const char *interface;   // lwIP interface to bind to (e.g. "st1"), NULL for any
+    int rx_buffer_size;      // Largest datagram that can be received
+    const char *state_cache; // NVS namespace the last known status is kept in, NULL to disable
+    unsigned long cache_write_millis; // Delay before a status change is written to flash
 };
 
 class GvmLightControl {
   public:
     GvmLightControl(bool debug = false);
+    GvmLightControl(const GvmLightConfig &config, bool debug = false);
+    ~GvmLightControl();
     void debugOn();
     
     void process_messages();
     int find_and_join_light_wifi(int *networks_found);  
     int wait_msg_or_timeout();
+    int wait_until(unsigned long deadline);
+    void wake();
+    void setPowerSave(bool enable);
     int send_hello_msg();
     int send_set_cmd(uint8_t setting, uint8_t value);
     int send_set_cmd_and_hello(uint8_t setting, uint8_t value);
@@ -112,6 +123,11 @@ class GvmLightControl {
     void callbackOnStatusUpdated(void (*callback)());
 
     LightStatus getLightStatus();
+    void setLightStatus(const LightStatus &status);
+    unsigned long getStatusMillis();
+    const GvmLightConfig &getConfig();
+    int getCachedStatus(const uint8_t *bssid, LightStatus *status);
+    void flushStateCache();
     int getOnOff();
     int getChannel();
     int getHue();
@@ -127,20 +143,48 @@ class GvmLightControl {
     int setSaturation(int saturation);
 
     int broadcast_udp(const void *d, int len);
+    int test_light_connection();
     
   private:
-    int test_light_connection();
     int read_udp(int fd);
     int try_connect_wifi(const char *ssid, const char *password, int channel, uint8_t *bssid);
+    int open_wake_port();
+    int open_udp_port(int *fd, int port);
+    void scan_wifi_networks();
+    void clear_wifi();
+    void load_state_cache();
+    void update_state_cache();
+    void select_cached_device(const uint8_t *bssid);
+    void write_behind();
+
+    // Instances own sockets and buffers, they can't be copied
+    GvmLightControl(const GvmLightControl &) = delete;
+    GvmLightControl &operator=(const GvmLightControl &) = delete;
   
   private:
+    GvmLightConfig config;
+    int debug_msgs;
+    volatile int disconnected;
+    wifi_event_id_t disconnect_event;
+    unsigned char *rx_buffer;
     LightStatus light_status;
-    int udp_2525_fd;
-    int udp_1112_fd;    
+    unsigned long status_millis;
+    uint8_t cache_ids[GVM_CACHE_DEVICES][GVM_SNAPSHOT_ID_LEN]; // BSSIDs, most recently heard first
+    LightStatus cache_status[GVM_CACHE_DEVICES];
+    int cache_count;
+    int cache_loaded;
+    int cache_dirty;
+    unsigned long cache_dirty_millis;
+    int udp_send_fd;
+    int udp_recv_fd;    
+    int wake_fd;
+    uint16_t wake_port;
+    int cpu_mhz;        // Clock the application runs at, set while power saving
     void (*onWiFiConnectAttempt)(uint8_t *bssid, int attempt);
     void (*onStatusUpdated)();
 };
 
-static GvmLightControl GVM;
+/* Default instance for the common case of a single lighting network */
+extern GvmLightControl GVM;
 
 #endif
@@ -0,0 +1,287 @@
+#include "WiFi.h"
+#include "GvmNetworkScheduler.h"
+
+#define DEBUG(format, ...) if (debug_msgs) { log_printf(format, ##__VA_ARGS__); };
+
+int GvmEspWiFiLayer::scan(const char *ssid, GvmNetworkInfo *found, int max_found) {
+  int n = WiFi.scanNetworks();
+  int matched = 0;
+
+  for (int i = 0; i < n && matched < max_found; i++) {
+    if (strcmp(WiFi.SSID(i).c_str(), ssid))
+      continue;
+    memcpy(found[matched].bssid, WiFi.BSSID(i), sizeof(found[matched].bssid));
+    found[matched].channel = WiFi.channel(i);
+    found[matched].rssi = WiFi.RSSI(i);
+    matched++;
+  }
+
+  WiFi.scanDelete();
+  return matched;
+}
+
+/* Connected to the network, and not still to the one we're leaving */
+static int joined(const GvmNetworkInfo &network) {
+  uint8_t *bssid = WiFi.BSSID();
+  return WiFi.status() == WL_CONNECTED && bssid && !memcmp(bssid, network.bssid, sizeof(network.bssid));
+}
+
+int GvmEspWiFiLayer::join(const char *ssid, const char *password, const GvmNetworkInfo &network,
+                          uint32_t *ip, uint32_t *gateway, uint32_t *subnet) {
+  // Reusing the address from an earlier visit skips DHCP, which is most
+  // of the time taken to reassociate
+  if (*ip)
+    WiFi.config(IPAddress(*ip), IPAddress(*gateway), IPAddress(*subnet));
+  else
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+
+  // Giving the channel and BSSID means no scan is needed
+  WiFi.begin(ssid, password, network.channel, network.bssid);
+
+  // begin() is asynchronous, until the disconnect from the previous light
+  // is handled the status can still read connected to it
+  unsigned long start = millis();
+  while (!joined(network) && millis() - start < GVM_JOIN_TIMEOUT_MILLIS)
+    delay(10);
+
+  if (!joined(network))
+    return -1;
+
+  *ip = WiFi.localIP();
+  *gateway = WiFi.gatewayIP();
+  *subnet = WiFi.subnetMask();
+  return 0;
+}
+
+GvmNetworkScheduler::GvmNetworkScheduler(GvmLightControl &lights, GvmWiFiLayer *wifi) : lights(lights) {
+  this->wifi = wifi ? wifi : &esp_wifi;
+  num_networks = 0;
+  next_network = 0;
+  debug_msgs = 0;
+}
+
+void GvmNetworkScheduler::debugOn() {
+  debug_msgs = 1;
+}
+
+/* Scan for light networks and remember any new ones, returns the number known */
+int GvmNetworkScheduler::discover() {
+  GvmNetworkInfo found[GVM_MAX_NETWORKS];
+  int n = wifi->scan(lights.getConfig().ssid, found, GVM_MAX_NETWORKS);
+  DEBUG("Scan found %d light networks\n", n);
+
+  for (int i = 0; i < n; i++)
+    add_network(found[i]);
+
+  return num_networks;
+}
+
+/* Remember a light network, returns its index or -1 if there's no room */
+int GvmNetworkScheduler::add_network(const GvmNetworkInfo &network) {
+  for (int i = 0; i < num_networks; i++) {
+    if (!memcmp(networks[i].info.bssid, network.bssid, sizeof(network.bssid))) {
+      // The light may have moved channel since we last saw it
+      networks[i].info = network;
+      return i;
+    }
+  }
+
+  if (num_networks == GVM_MAX_NETWORKS)
+    return -1;
+
+  networks[num_networks] = Network();
+  networks[num_networks].info = network;
+  // Start from the last known status, unconfirmed until the light reports
+  lights.getCachedStatus(network.bssid, &networks[num_networks].status);
+  DEBUG("Added network %d, BSSID %02x:%02x:%02x:%02x:%02x:%02x channel %d\n", num_networks,
+        network.bssid[0], network.bssid[1], network.bssid[2], network.bssid[3], network.bssid[4], network.bssid[5],
+        network.channel);
+  return num_networks++;
+}
+
+int GvmNetworkScheduler::network_count() {
+  return num_networks;
+}
+
+/* Queue a setting for the light on a network, it is sent on the next visit
+ * unless the light reports it already has that value. Later settings 
+ * replace earlier ones that haven't been sent */
+int GvmNetworkScheduler::queue_set(int network, uint8_t setting, int value) {
+  int min, max;
+  if (network < 0 || network >= num_networks || gvm_var_range(setting, &min, &max))
+    return -1;
+  if (value < min)
+    value = min;
+  else if (value > max)
+    value = max;
+
+  // Not compared with the status here, it may be out of date by the visit
+  Network &net = networks[network];
+  net.pending_value[setting] = value;
+  net.pending_mask |= 1 << setting;
+  return 0;
+}
+
+int GvmNetworkScheduler::queue_set_all(uint8_t setting, int value) {
+  for (int i = 0; i < num_networks; i++)
+    if (queue_set(i, setting, value))
+      return -1;
+  return 0;
+}
+
+int GvmNetworkScheduler::pending_count(int network) {
+  if (network < 0 || network >= num_networks)
+    return 0;
+  return __builtin_popcount(networks[network].pending_mask);
+}
+
+/* Hop to the next network and bring it up to date. Networks with settings
+ * waiting go first, otherwise the networks take turns so each light's
+ * status is refreshed. Networks resting after failed visits are skipped 
+ * unless every network is resting. Returns the number of settings sent 
+ * or -1 if the light couldn't be reached */
+int GvmNetworkScheduler::visit_next() {
+  if (!num_networks)
+    return -1;
+
+  int chosen = -1;
+  for (int i = 0; i < num_networks && chosen == -1; i++) {
+    int n = (next_network + i) % num_networks;
+    if (networks[n].pending_mask && !resting(n))
+      chosen = n;
+  }
+  for (int i = 0; i < num_networks && chosen == -1; i++) {
+    int n = (next_network + i) % num_networks;
+    if (!resting(n))
+      chosen = n;
+  }
+  if (chosen == -1)
+    chosen = next_network % num_networks;
+
+  next_network = (chosen + 1) % num_networks;
+  return visit(chosen);
+}
+
+/* A network whose last visits failed is left alone for a while, longer
+ * after each failure, so it doesn't cost a join timeout on every turn */
+bool GvmNetworkScheduler::resting(int network) {
+  Network &net = networks[network];
+  if (!net.failures)
+    return false;
+  int doublings = net.failures - 1 < 4 ? net.failures - 1 : 4;
+  return millis() - net.fail_millis < (GVM_FAIL_BACKOFF_MILLIS << doublings);
+}
+
+int GvmNetworkScheduler::visit(int network) {
+  Network &net = networks[network];
+  const GvmLightConfig &config = lights.getConfig();
+
+  // The controller holds the cached status of the light while we're on its network
+  lights.setLightStatus(net.status);
+
+  unsigned long start = millis();
+  if (wifi->join(config.ssid, config.password, net.info, &net.ip, &net.gateway, &net.subnet)) {
+    DEBUG("Couldn't join network %d\n", network);
+    net.failures++;
+    net.fail_millis = millis();
+    // The address we reused may no longer be valid, use DHCP next time
+    net.ip = 0;
+    return -1;
+  }
+
+  net.hop_millis = millis() - start;
+  net.total_hop_millis += net.hop_millis;
+  net.hops++;
+  DEBUG("Joined network %d in %lu ms\n", network, net.hop_millis);
+
+  // Open the sockets and wait for the light to report
+  unsigned long connected = millis();
+  if (lights.test_light_connection()) {
+    DEBUG("No response from the light on network %d\n", network);
+    net.failures++;
+    net.fail_millis = millis();
+    return -1;
+  }
+
+  // Send everything queued in one go, skipping what the light confirmed it already has
+  LightStatus current = lights.getLightStatus();
+  int sent = 0;
+  for (int var = 0; var < LIGHT_VAR_COUNT; var++) {
+    if (!(net.pending_mask & (1 << var)) || 
+        (current.confirmed && *gvm_status_var(&current, var) == net.pending_value[var]))
+      continue;
+    if (sent) {
+      // wait_until returns early for any light message, e.g. the ack to the last set
+      unsigned long paced = millis() + GVM_SEND_PACE_MILLIS;
+      while ((long) (paced - millis()) > 0)
+        lights.wait_until(paced);
+    }
+    lights.send_set_cmd(var, net.pending_value[var]);
+    sent++;
+  }
+  if (sent) {
+    // Acks to the earlier sets may have arrived while pacing, wait for what follows the last
+    unsigned long last_report = lights.getStatusMillis();
+    lights.send_hello_msg();
+    wait_for_status(last_report);
+  }
+
+  // Lights drop sets, keep any the light doesn't report for the next visit
+  net.status = lights.getLightStatus();
+  int unapplied = 0;
+  for (int var = 0; var < LIGHT_VAR_COUNT; var++)
+    if ((net.pending_mask & (1 << var)) && *gvm_status_var(&net.status, var) != net.pending_value[var])
+      unapplied |= 1 << var;
+  net.resends = unapplied ? net.resends + 1 : 0;
+  if (net.resends > GVM_MAX_RESENDS) {
+    DEBUG("Network %d didn't apply settings 0x%x, giving up on them\n", network, unapplied);
+    unapplied = 0;
+    net.resends = 0;
+  }
+  net.pending_mask = unapplied;
+
+  if ((long) (lights.getStatusMillis() - connected) >= 0)
+    net.seen_millis = lights.getStatusMillis();
+  net.failures = 0;
+  return sent;
+}
+
+/* Wait for a report newer than the one at last_report. Comparing with
+ * the time of sending would miss a report in the same millisecond */
+void GvmNetworkScheduler::wait_for_status(unsigned long last_report) {
+  unsigned long deadline = millis() + GVM_STATUS_WAIT_MILLIS;
+  while ((long) (deadline - millis()) > 0 && lights.getStatusMillis() == last_report)
+    lights.wait_until(deadline);
+}
+
+LightStatus GvmNetworkScheduler::getNetworkStatus(int network) {
+  if (network < 0 || network >= num_networks)
+    return LightStatus();
+  return networks[network].status;
+}
+
+const uint8_t *GvmNetworkScheduler::getBssid(int network) {
+  if (network < 0 || network >= num_networks)
+    return NULL;
+  return networks[network].info.bssid;
+}
+
+/* Milliseconds since the light on a network last reported, GVM_NEVER if it hasn't */
+unsigned long GvmNetworkScheduler::getStaleness(int network) {
+  if (network < 0 || network >= num_networks || !networks[network].seen_millis)
+    return GVM_NEVER;
+  return millis() - networks[network].seen_millis;
+}
+
+/* Milliseconds the last join of a network took, GVM_NEVER if it hasn't been joined */
+unsigned long GvmNetworkScheduler::getHopMillis(int network) {
+  if (network < 0 || network >= num_networks || !networks[network].hops)
+    return GVM_NEVER;
+  return networks[network].hop_millis;
+}
+
+unsigned long GvmNetworkScheduler::getAverageHopMillis(int network) {
+  if (network < 0 || network >= num_networks || !networks[network].hops)
+    return GVM_NEVER;
+  return networks[network].total_hop_millis / networks[network].hops;
+}
@@ -0,0 +1,110 @@
+/*
+  GvmNetworkScheduler.h - Drive GVM lights that are on separate WiFi networks.
+
+  Every light creates its own network and the networks are not linked, so
+  a controller can only talk to the light whose network it is joined to.
+  The scheduler remembers every light network it has discovered along with
+  a queue of settings and the last status of each light, and hops between
+  the networks in turn. All the settings queued for a light are sent in a
+  single visit.
+*/
+
+#ifndef GvmNetworkScheduler_h
+#define GvmNetworkScheduler_h
+
+#include "GvmLightControl.h"
+
+#define GVM_MAX_NETWORKS          8
+#define GVM_JOIN_TIMEOUT_MILLIS   3500 // Longest to wait for an association
+#define GVM_STATUS_WAIT_MILLIS    500  // Longest to wait for a status report after sending
+#define GVM_SEND_PACE_MILLIS      25   // Gap between sets, lights drop sets sent too quickly
+#define GVM_MAX_RESENDS           3    // Visits a set the light doesn't apply is sent again on
+#define GVM_FAIL_BACKOFF_MILLIS   10000UL // Rest after a failed visit, doubled for each failure in a row up to 16x
+#define GVM_NEVER                 ((unsigned long) -1)
+
+/* A light network found by a scan */
+class GvmNetworkInfo {
+  public:
+    GvmNetworkInfo() : channel(0), rssi(0) { memset(bssid, 0, sizeof(bssid)); };
+
+  public:
+    uint8_t bssid[6];
+    int channel;
+    int rssi;
+};
+
+/* The WiFi operations the scheduler needs, so it can run against a mock */
+class GvmWiFiLayer {
+  public:
+    virtual ~GvmWiFiLayer() {};
+
+    /* Scan for networks named ssid, returns the number written to found */
+    virtual int scan(const char *ssid, GvmNetworkInfo *found, int max_found) = 0;
+
+    /* Join a network on its channel and BSSID, returns 0 once connected. If
+     * *ip is set the address is reused instead of waiting for DHCP, on
+     * success ip, gateway and subnet are set to the address in use. The
+     * addresses are in the form IPAddress converts to and from */
+    virtual int join(const char *ssid, const char *password, const GvmNetworkInfo &network,
+                     uint32_t *ip, uint32_t *gateway, uint32_t *subnet) = 0;
+};
+
+/* GvmWiFiLayer using the ESP32 WiFi station */
+class GvmEspWiFiLayer : public GvmWiFiLayer {
+  public:
+    int scan(const char *ssid, GvmNetworkInfo *found, int max_found);
+    int join(const char *ssid, const char *password, const GvmNetworkInfo &network,
+             uint32_t *ip, uint32_t *gateway, uint32_t *subnet);
+};
+
+class GvmNetworkScheduler {
+  public:
+    GvmNetworkScheduler(GvmLightControl &lights, GvmWiFiLayer *wifi = NULL);
+    void debugOn();
+
+    int discover();
+    int add_network(const GvmNetworkInfo &network);
+    int network_count();
+    int visit_next();
+
+    int queue_set(int network, uint8_t setting, int value);
+    int queue_set_all(uint8_t setting, int value);
+    int pending_count(int network);
+
+    LightStatus getNetworkStatus(int network);
+    const uint8_t *getBssid(int network);
+    unsigned long getStaleness(int network);
+    unsigned long getHopMillis(int network);
+    unsigned long getAverageHopMillis(int network);
+
+  private:
+    int visit(int network);
+    bool resting(int network);
+    void wait_for_status(unsigned long last_report);
+
+  private:
+    struct Network {
+      GvmNetworkInfo info;
+      LightStatus status;                 // Last status reported by the light
+      int pending_value[LIGHT_VAR_COUNT]; // Settings to send on the next visit
+      int pending_mask;                   // Bit (1 << LIGHT_VAR_x) set if pending_value[x] is to be sent
+      uint32_t ip, gateway, subnet;       // Address from the first join, reused to skip DHCP
+      unsigned long seen_millis;          // millis() of the last status report, 0 if never
+      unsigned long hop_millis;           // Time taken to join on the last visit
+      unsigned long total_hop_millis;
+      int hops;
+      int resends;                        // Visits in a row that left sets unapplied
+      int failures;                       // Consecutive failed visits
+      unsigned long fail_millis;          // millis() of the last failed visit
+    };
+
+    GvmLightControl &lights;
+    GvmEspWiFiLayer esp_wifi;
+    GvmWiFiLayer *wifi;
+    Network networks[GVM_MAX_NETWORKS];
+    int num_networks;
+    int next_network;
+    int debug_msgs;
+};
+
+#endif
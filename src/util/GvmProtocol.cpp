@@ -0,0 +1,203 @@
+#include <stddef.h>
+#include <string.h>
+#include "HexFunctions.h"
+#include "GvmProtocol.h"
+
+/* When the app first connects it broadcasts this message. This
+ * causes the light to respond with a 0x53 message then send
+ * a 0x03 status message */
+const char *gvm_hello_msg = "4C5409000053000001009474";
+/* Response msg sometimes   "4C540A00305300000220382B19"  */
+
+/* Read the byte at byte offset 'at' of a hex encoded message */
+static inline int hex_byte(const char *hex, int at) {
+  return charToVal(hex[at * 2]) << 4 | charToVal(hex[at * 2 + 1]);
+}
+
+// CRC-16/XMODEM, see https://crccalc.com/ or https://www.tahapaksu.com/crc/
+static inline uint16_t crc_update(uint16_t crc, unsigned char c) {
+  crc ^= c << 8;
+  for (int i = 0; i < 8; i++) {
+    if (crc & 0x8000)
+      crc = (crc << 1) ^ 0x1021;
+    else
+      crc = crc << 1;
+  }
+  return crc;
+}
+
+uint16_t calcCrcFromHexStr(const char *str, int len) {
+  uint16_t crc = 0;
+  unsigned char c;
+  while (len >= 2) {
+    c = (charToVal(*str++) << 4);
+    c += charToVal(*str++);
+    crc = crc_update(crc, c);
+    len -= 2;
+  }
+  return crc & 0xFFFF;
+}
+
+static uint16_t calc_crc(const uint8_t *d, int len) {
+  uint16_t crc = 0;
+  while (len-- > 0)
+    crc = crc_update(crc, *d++);
+  return crc & 0xFFFF;
+}
+
+int *gvm_status_var(LightStatus *status, int var) {
+  switch (var) {
+    case LIGHT_VAR_ON_OFF:     return &status->on_off;
+    case LIGHT_VAR_CHANNEL:    return &status->channel;
+    case LIGHT_VAR_BRIGHTNESS: return &status->brightness;
+    case LIGHT_VAR_CCT:        return &status->cct;
+    case LIGHT_VAR_HUE:        return &status->hue;
+    case LIGHT_VAR_SATURATION: return &status->saturation;
+  }
+  return NULL;
+}
+
+int gvm_var_range(int var, int *min, int *max) {
+  switch (var) {
+    case LIGHT_VAR_ON_OFF:     *min = 0;  *max = 1;   break;
+    case LIGHT_VAR_CHANNEL:    *min = 1;  *max = 12;  break;
+    case LIGHT_VAR_BRIGHTNESS: *min = 0;  *max = 100; break; // Percent
+    case LIGHT_VAR_CCT:        *min = 32; *max = 56;  break; // x 100 kelvin
+    case LIGHT_VAR_HUE:        *min = 0;  *max = 72;  break; // x 5 degrees
+    case LIGHT_VAR_SATURATION: *min = 0;  *max = 100; break; // Percent
+    default:
+      return -1;
+  }
+  return 0;
+}
+
+int gvm_build_set_cmd(uint8_t setting, uint8_t value, char *out) {
+  unsigned char cmd_buffer[GVM_SET_CMD_HEX_LEN / 2];
+
+  /* Example to turn light off '4C5409003057000201005C9E' */
+  cmd_buffer[0] = 'L';
+  cmd_buffer[1] = 'T';
+  cmd_buffer[2] = sizeof(cmd_buffer) - 3;
+  cmd_buffer[3] = 0x0;
+  cmd_buffer[4] = 0x30;
+  cmd_buffer[5] = LIGHT_MSG_SETVAR;
+  cmd_buffer[6] = 0x0;
+  cmd_buffer[7] = setting;
+  cmd_buffer[8] = 0x1;
+  cmd_buffer[9] = value;
+
+  bytesToHexString(cmd_buffer, sizeof(cmd_buffer) - 2, out);
+  unsigned short crc = calcCrcFromHexStr(out, (sizeof(cmd_buffer) - 2) * 2);
+  shortToHex(crc, out + GVM_SET_CMD_HEX_LEN - 4);
+
+  return GVM_SET_CMD_HEX_LEN;
+}
+
+static void apply_var(LightStatus *status, int var, int value, int *changed_mask) {
+  int *field = gvm_status_var(status, var);
+  if (!field || *field == value)
+    return;
+  *field = value;
+  *changed_mask |= 1 << var;
+}
+
+int gvm_parse_msgs(const char *hex, int len, LightStatus *status, int *changed_mask, int *status_msgs) {
+  int msgs_processed = 0;
+  int reports = 0;
+  int changed = 0;
+
+  /* In some cases many messages can be received in a single datagram,
+   * decode straight from the hex string so no buffer is needed */
+  while (len >= (3 * 2) &&
+         hex_byte(hex, 0) == 'L' /* 0x4C */ &&
+         hex_byte(hex, 1) == 'T' /* 0x54 */ &&
+         hex_byte(hex, 2) >= 2 + 3 &&
+         hex_byte(hex, 2) <= len / 2 - 3) {
+    int payload_len = hex_byte(hex, 2);
+    int msglen = 3 + payload_len;
+
+    /* Might be a GVM light message, check the CRC */
+    unsigned short crc = calcCrcFromHexStr(hex, (msglen - 2) * 2);
+    unsigned short msgcrc = hex_byte(hex, msglen - 2) << 8 | hex_byte(hex, msglen - 1);
+
+    /* If this is not a light message stop decoding */
+    if (crc != msgcrc)
+      break;
+
+    msgs_processed++;
+
+    int msg_type = hex_byte(hex, 5);
+    if (msg_type == LIGHT_MSG_VAR_ALL && payload_len >= 3 + LIGHT_VAR_COUNT + 2) {
+      /* Status message sent periodically by the lights, the fields
+       * are in LIGHT_VAR_ order */
+      for (int var = 0; var < LIGHT_VAR_COUNT; var++)
+        apply_var(status, var, hex_byte(hex, 6 + var), &changed);
+      status->confirmed = 1;
+      reports++;
+    } else if (msg_type == LIGHT_MSG_VAR_SET && payload_len >= 3 + 3 + 2) {
+      /* Updated message, send in response to an update message
+      e.g '4C54080030020002003A89' received from sending a brightness zero message '4C5409003057000201005C9E'
+      or  '4C54080030020002030AEA' received from sending a brightness 3% message   '4C5409003057000201036CFD' */
+      apply_var(status, hex_byte(hex, 7), hex_byte(hex, 8), &changed);
+      reports++;
+    }
+
+    len -= msglen * 2;
+    hex += msglen * 2;
+  }
+
+  if (changed_mask)
+    *changed_mask = changed;
+  if (status_msgs)
+    *status_msgs = reports;
+  return msgs_processed;
+}
+
+int gvm_snapshot_encode(const uint8_t ids[][GVM_SNAPSHOT_ID_LEN], const LightStatus *status, int count,
+                        uint8_t *out, int out_len) {
+  int len = GVM_SNAPSHOT_LEN(count);
+  if (count > 0xFF || len > out_len)
+    return -1;
+
+  uint8_t *p = out;
+  *p++ = 'G';
+  *p++ = 'S';
+  *p++ = GVM_SNAPSHOT_VERSION;
+  *p++ = count;
+  for (int i = 0; i < count; i++) {
+    memcpy(p, ids[i], GVM_SNAPSHOT_ID_LEN);
+    p += GVM_SNAPSHOT_ID_LEN;
+    for (int var = 0; var < LIGHT_VAR_COUNT; var++) {
+      int value = *gvm_status_var((LightStatus *) &status[i], var);
+      *p++ = value < 0 || value > 0xFE ? 0xFF : value;
+    }
+  }
+
+  uint16_t crc = calc_crc(out, p - out);
+  *p++ = crc >> 8;
+  *p++ = crc & 0xFF;
+  return len;
+}
+
+int gvm_snapshot_decode(const uint8_t *in, int len, uint8_t ids[][GVM_SNAPSHOT_ID_LEN], LightStatus *status,
+                        int max_count) {
+  if (len < GVM_SNAPSHOT_LEN(0) || in[0] != 'G' || in[1] != 'S' || in[2] != GVM_SNAPSHOT_VERSION)
+    return -1;
+
+  int count = in[3];
+  if (len != GVM_SNAPSHOT_LEN(count) || calc_crc(in, len - 2) != (in[len - 2] << 8 | in[len - 1]))
+    return -1;
+
+  const uint8_t *p = in + 4;
+  if (count > max_count)
+    count = max_count;
+  for (int i = 0; i < count; i++) {
+    memcpy(ids[i], p, GVM_SNAPSHOT_ID_LEN);
+    p += GVM_SNAPSHOT_ID_LEN;
+    status[i] = LightStatus();
+    for (int var = 0; var < LIGHT_VAR_COUNT; var++, p++)
+      *gvm_status_var(&status[i], var) = *p == 0xFF ? -1 : *p;
+  }
+
+  return count;
+}
@@ -0,0 +1,80 @@
+#ifndef GvmProtocol_h
+#define GvmProtocol_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Encoding and decoding of the GVM 'LT' messages. This has no Arduino
+ * or ESP32 dependencies so it can be shared between the library and
+ * the Linux tools in extras/. See GvmLightControl.h for a description
+ * of the message format.
+ */
+
+#define GVM_SEND_PORT        2525 // Port the lights listen on
+#define GVM_RECV_PORT        1112 // Port the lights broadcast status to
+
+#define LIGHT_VAR_ON_OFF     0
+#define LIGHT_VAR_CHANNEL    1
+#define LIGHT_VAR_BRIGHTNESS 2
+#define LIGHT_VAR_CCT        3
+#define LIGHT_VAR_HUE        4
+#define LIGHT_VAR_SATURATION 5
+#define LIGHT_VAR_COUNT      6
+
+#define LIGHT_MSG_SETVAR     0x57 // Send to set a variable
+#define LIGHT_MSG_VAR_SET    0x2  // Response to a variable set
+#define LIGHT_MSG_VAR_ALL    0x3  // Periodic message with all variable settings
+
+#define GVM_SET_CMD_HEX_LEN  ((3 + 3 + 4 + 2) * 2) // Length of an encoded set command
+
+/* Snapshots of the last known status of a number of devices are 'GS', a
+ * version byte and a device count, then for each device a 6 byte ID (e.g.
+ * the BSSID of the light's network) followed by one byte per LIGHT_VAR_
+ * (0xFF if unknown), then a CRC-16/XMODEM of everything before it */
+#define GVM_SNAPSHOT_VERSION 1
+#define GVM_SNAPSHOT_ID_LEN  6
+#define GVM_SNAPSHOT_LEN(count) (4 + (count) * (GVM_SNAPSHOT_ID_LEN + LIGHT_VAR_COUNT) + 2)
+
+class LightStatus {
+  public:
+    LightStatus() : on_off(-1), channel(-1), hue(-1), brightness(-1), cct(-1), saturation(-1), confirmed(0) {};
+
+  public:
+    int on_off;
+    int channel;
+    int hue;
+    int brightness;
+    int cct;
+    int saturation;
+    int confirmed;  // 1 once a status report from the light replaced any cached values
+};
+
+extern const char *gvm_hello_msg;
+
+uint16_t calcCrcFromHexStr(const char *str, int len);
+
+/* Returns a pointer to the field of status for a LIGHT_VAR_ value, or NULL */
+int *gvm_status_var(LightStatus *status, int var);
+
+/* Get the range of raw values the light accepts for a LIGHT_VAR_ value, returns -1 if unknown */
+int gvm_var_range(int var, int *min, int *max);
+
+/* Encode a set command into out, which must hold GVM_SET_CMD_HEX_LEN chars. Returns the length */
+int gvm_build_set_cmd(uint8_t setting, uint8_t value, char *out);
+
+/* Decode all the messages in a received datagram and apply any status they carry.
+ * Returns the number of valid messages, changed_mask (if set) has bit (1 << LIGHT_VAR_x)
+ * set for each field whose value changed and status_msgs (if set) is the number of
+ * messages that reported status, whether or not anything changed */
+int gvm_parse_msgs(const char *hex, int len, LightStatus *status, int *changed_mask, int *status_msgs = NULL);
+
+/* Encode the status of count devices into out, returns the length or -1 if out_len is too small */
+int gvm_snapshot_encode(const uint8_t ids[][GVM_SNAPSHOT_ID_LEN], const LightStatus *status, int count,
+                        uint8_t *out, int out_len);
+
+/* Decode up to max_count devices from a snapshot, returns the number decoded or -1 if the 
+ * snapshot is corrupt or from another version. The decoded status is not confirmed */
+int gvm_snapshot_decode(const uint8_t *in, int len, uint8_t ids[][GVM_SNAPSHOT_ID_LEN], LightStatus *status,
+                        int max_count);
+
+#endif
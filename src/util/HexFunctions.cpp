@@ -1,5 +1,10 @@
+#ifdef ARDUINO
 #include <Arduino.h>
 #include <lwip/sockets.h>
+#else
+// Built outside of Arduino, e.g. for the Linux tools in extras/
+#include <arpa/inet.h>
+#endif
 #include "HexFunctions.h"
 
 /* Convert a hexadecimal character to its value */
@@ -23,6 +28,7 @@ void hexStringToBytes(char *hexstr, int len, unsigned char *out) {
   return; 
 }
 
+#ifdef ARDUINO
 StreamString printAsHex(char *buf, int len, char *prompt) {
   StreamString o;
   o.print(prompt ? prompt : "Hex: ");
@@ -40,6 +46,7 @@ StreamString printAsHex(char *buf, int len, char *prompt) {
   o.println();
   return o;  
 }
+#endif
 
 void bytesToHexString(unsigned char *in, int len, char *out) {
   for (int i = 0; i < len; i++) {
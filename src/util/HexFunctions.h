@@ -1,13 +1,18 @@
 #ifndef HexFunctions_h
 #define HexFunctions_h
 
+#include <stdint.h>
+#ifdef ARDUINO
 #include <StreamString.h>
+#endif
 
 uint8_t charToVal(char c);
 char valToChar(uint8_t v);
 void hexStringToBytes(char *hexstr, int len, unsigned char *out);
 void bytesToHexString(unsigned char *in, int len, char *out);
 void shortToHex(unsigned short num, char *out);
+#ifdef ARDUINO
 StreamString printAsHex(char *buf, int len, char *prompt);
+#endif
 
 #endif